@@ -0,0 +1,434 @@
+#ifndef DURABLEMAP_HPP_INCLUDED
+#define DURABLEMAP_HPP_INCLUDED
+
+#include "Map.hpp"
+#include <fstream>
+#include <sstream>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cerrno>
+
+namespace kanec1994
+{
+
+/*Turns keys and values into log bytes and back. Trivially copyable types
+are stored as their raw bytes; specialize LogCodec for anything else.*/
+template<typename T, typename Enable = void>
+struct LogCodec;
+
+template<typename T>
+struct LogCodec<T, typename std::enable_if<std::is_trivially_copyable<T>::value>::type>
+{
+    static void encode(const T &item, std::string &out)
+    {
+        out.append(reinterpret_cast<const char *>(&item), sizeof(T));
+    }
+    static bool decode(const char *&pos, const char *end, T &item)
+    {
+        if(static_cast<size_t>(end - pos) < sizeof(T))
+        {
+            return false;
+        }
+        std::memcpy(&item, pos, sizeof(T));
+        pos += sizeof(T);
+        return true;
+    }
+};
+
+/*std::string is stored as a 64 bit length followed by its bytes*/
+template<>
+struct LogCodec<std::string>
+{
+    static void encode(const std::string &item, std::string &out)
+    {
+        LogCodec<uint64_t>::encode(item.size(), out);
+        out.append(item);
+    }
+    static bool decode(const char *&pos, const char *end, std::string &item)
+    {
+        uint64_t length;
+        if(!LogCodec<uint64_t>::decode(pos, end, length) || static_cast<uint64_t>(end - pos) < length)
+        {
+            return false;
+        }
+        item.assign(pos, length);
+        pos += length;
+        return true;
+    }
+};
+
+/*When a DurableMap forces logged records to disk*/
+enum class SyncMode
+{
+    none,   //hand each group to the OS, never fsync
+    group,  //fsync once per group commit
+    always  //commit and fsync after every write
+};
+
+/*A Map whose changes survive restarts. Each insert and erase is appended
+to path.log; records are buffered and written as one group once
+group_bytes accumulate or commit() is called, so a single write and fsync
+covers many changes. Once the log passes checkpoint_bytes the whole Map is
+written in key order to path.ckpt and the log starts over. Opening
+recovers by loading the checkpoint with a linear-time build and then
+replaying the log tail; a torn record at the end of the log is dropped.
+Changes since the last commit() are lost on a crash.*/
+template<typename Key_T, typename Mapped_T>
+class DurableMap
+{
+private:
+    Map<Key_T, Mapped_T> entries;
+    std::string log_path;
+    std::string checkpoint_path;
+    SyncMode sync_mode;
+    size_t group_bytes;
+    size_t checkpoint_bytes;
+    std::string pending;
+    size_t log_size;
+    int log_fd;
+
+    static const char put_record = 'P';
+    static const char erase_record = 'E';
+
+    /*FNV-1a, used to spot torn or corrupt records*/
+    static uint32_t checksum(const char *data, size_t length)
+    {
+        uint32_t hash = 2166136261u;
+        for(size_t i = 0; i < length; i++)
+        {
+            hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+        }
+        return hash;
+    }
+    /*Frame a record as length, checksum, type, key and value (puts only)
+    and append it to out in one step, so a failure leaves out as it was*/
+    static void append_record(std::string &out, char type, const Key_T &key, const Mapped_T *value)
+    {
+        std::string payload(1, type);
+        LogCodec<Key_T>::encode(key, payload);
+        if(value != nullptr)
+        {
+            LogCodec<Mapped_T>::encode(*value, payload);
+        }
+        std::string frame;
+        LogCodec<uint32_t>::encode(static_cast<uint32_t>(payload.size()), frame);
+        LogCodec<uint32_t>::encode(checksum(payload.data(), payload.size()), frame);
+        frame.append(payload);
+        out.append(frame);
+    }
+    /*Parse the next framed record. Returns false at the end of the data or
+    at the first incomplete or corrupt record.*/
+    static bool read_record(const char *&pos, const char *end, char &type, Key_T &key, Mapped_T &value)
+    {
+        const char *start = pos;
+        uint32_t length, sum;
+        if(!LogCodec<uint32_t>::decode(start, end, length) || !LogCodec<uint32_t>::decode(start, end, sum)
+            || static_cast<size_t>(end - start) < length || length == 0
+            || checksum(start, length) != sum)
+        {
+            return false;
+        }
+        const char *record_end = start + length;
+        type = *start++;
+        if(!LogCodec<Key_T>::decode(start, record_end, key))
+        {
+            return false;
+        }
+        if(type == put_record && !LogCodec<Mapped_T>::decode(start, record_end, value))
+        {
+            return false;
+        }
+        if(start != record_end || (type != put_record && type != erase_record))
+        {
+            return false;
+        }
+        pos = record_end;
+        return true;
+    }
+    static std::string read_file(const std::string &path)
+    {
+        std::ifstream in(path, std::ios::binary);
+        std::ostringstream contents;
+        contents << in.rdbuf();
+        return contents.str();
+    }
+    static void write_all(int fd, const std::string &data, const std::string &path)
+    {
+        const char *pos = data.data();
+        size_t left = data.size();
+        while(left > 0)
+        {
+            ssize_t written = ::write(fd, pos, left);
+            if(written < 0)
+            {
+                if(errno == EINTR)
+                {
+                    continue;
+                }
+                throw std::runtime_error("write failed: " + path);
+            }
+            pos += written;
+            left -= static_cast<size_t>(written);
+        }
+    }
+    static void sync_fd(int fd, const std::string &path)
+    {
+        if(::fsync(fd) != 0)
+        {
+            throw std::runtime_error("fsync failed: " + path);
+        }
+    }
+    /*fsync the directory holding path, making a create or rename of
+    path durable*/
+    static void sync_parent(const std::string &path)
+    {
+        size_t slash = path.rfind('/');
+        std::string dir = slash == std::string::npos ? "." : (slash == 0 ? "/" : path.substr(0, slash));
+        int fd = ::open(dir.c_str(), O_RDONLY | O_DIRECTORY);
+        if(fd < 0)
+        {
+            throw std::runtime_error("cannot open directory: " + dir);
+        }
+        int synced = ::fsync(fd);
+        ::close(fd);
+        if(synced != 0)
+        {
+            throw std::runtime_error("fsync failed: " + dir);
+        }
+    }
+    /*Load path.ckpt, replay path.log over it and cut off any torn tail*/
+    void recover()
+    {
+        std::string image = read_file(checkpoint_path);
+        std::vector<std::pair<Key_T, Mapped_T>> loaded;
+        const char *pos = image.data();
+        const char *end = pos + image.size();
+        char type;
+        Key_T key;
+        Mapped_T value;
+        while(pos != end)
+        {
+            if(!read_record(pos, end, type, key, value) || type != put_record)
+            {
+                throw std::runtime_error("corrupt checkpoint: " + checkpoint_path);
+            }
+            loaded.push_back({key, value});
+        }
+        entries.assign_sorted(loaded.begin(), loaded.end());
+        loaded.clear();
+
+        //replaying is idempotent, so a log already folded into the checkpoint is harmless
+        std::string log = read_file(log_path);
+        typename Map<Key_T, Mapped_T>::WriteBatch batch;
+        pos = log.data();
+        end = pos + log.size();
+        while(read_record(pos, end, type, key, value))
+        {
+            if(type == put_record)
+            {
+                batch.put(key, value);
+            }
+            else
+            {
+                batch.erase(key);
+            }
+        }
+        entries.apply(batch);
+
+        log_size = static_cast<size_t>(pos - log.data());
+        log_fd = ::open(log_path.c_str(), O_WRONLY | O_CREAT, 0644);
+        if(log_fd < 0)
+        {
+            throw std::runtime_error("cannot open log: " + log_path);
+        }
+        //the destructor will not run if the constructor throws, so close here
+        try
+        {
+            if(::ftruncate(log_fd, static_cast<off_t>(log_size)) != 0 || ::lseek(log_fd, 0, SEEK_END) < 0)
+            {
+                throw std::runtime_error("cannot open log: " + log_path);
+            }
+            if(sync_mode != SyncMode::none)
+            {
+                sync_fd(log_fd, log_path);
+                sync_parent(log_path);
+            }
+        }
+        catch(...)
+        {
+            ::close(log_fd);
+            log_fd = -1;
+            throw;
+        }
+    }
+    /*Write pending to the log and fsync unless the mode is none. On
+    failure the log is cut back to its last good size, so no partial
+    group is left behind, and pending is kept.*/
+    void flush()
+    {
+        if(pending.empty())
+        {
+            return;
+        }
+        try
+        {
+            write_all(log_fd, pending, log_path);
+            if(sync_mode != SyncMode::none)
+            {
+                sync_fd(log_fd, log_path);
+            }
+        }
+        catch(...)
+        {
+            if(::ftruncate(log_fd, static_cast<off_t>(log_size)) == 0)
+            {
+                ::lseek(log_fd, static_cast<off_t>(log_size), SEEK_SET);
+            }
+            throw;
+        }
+        log_size += pending.size();
+        pending.clear();
+    }
+    /*Queue a record, flushing if the group is full or the mode asks. If
+    the flush fails the record is dropped again and the error rethrown, so
+    the caller can leave the Map untouched.*/
+    void log_record(char type, const Key_T &key, const Mapped_T *value)
+    {
+        size_t mark = pending.size();
+        append_record(pending, type, key, value);
+        if(sync_mode == SyncMode::always || pending.size() >= group_bytes)
+        {
+            try
+            {
+                flush();
+            }
+            catch(...)
+            {
+                pending.resize(mark);
+                throw;
+            }
+        }
+    }
+    void checkpoint_if_due()
+    {
+        if(log_size >= checkpoint_bytes)
+        {
+            checkpoint();
+        }
+    }
+public:
+    DurableMap(const std::string &path, SyncMode mode = SyncMode::group,
+        size_t group_size = 64 * 1024, size_t checkpoint_size = 64 * 1024 * 1024)
+    {
+        log_path = path + ".log";
+        checkpoint_path = path + ".ckpt";
+        sync_mode = mode;
+        group_bytes = group_size;
+        checkpoint_bytes = checkpoint_size;
+        log_size = 0;
+        log_fd = -1;
+        recover();
+    }
+    DurableMap(const DurableMap &) = delete;
+    DurableMap &operator=(const DurableMap &) = delete;
+    ~DurableMap()
+    {
+        try
+        {
+            commit();
+        }
+        catch(...)
+        {
+
+        }
+        ::close(log_fd);
+    }
+    /*Read-only view of the current contents*/
+    const Map<Key_T, Mapped_T> &map() const
+    {
+        return entries;
+    }
+    /*Log the change, then apply it, so a failed log write leaves the Map
+    as it was*/
+    void insert_or_assign(const Key_T &key, const Mapped_T &value)
+    {
+        log_record(put_record, key, &value);
+        entries.insert_or_assign(key, value);
+        checkpoint_if_due();
+    }
+    /*Erase key, logging it only if it was present*/
+    bool erase(const Key_T &key)
+    {
+        if(entries.count(key) == 0)
+        {
+            return false;
+        }
+        log_record(erase_record, key, nullptr);
+        entries.erase(key);
+        checkpoint_if_due();
+        return true;
+    }
+    /*Write every buffered record to the log in one call, fsync unless the
+    mode is none, and checkpoint if the log has grown past its limit*/
+    void commit()
+    {
+        flush();
+        checkpoint_if_due();
+    }
+    /*Stream the whole Map in key order, one scan chunk at a time, to a
+    new checkpoint, swap it in with a rename, make the rename durable and
+    only then start an empty log*/
+    void checkpoint()
+    {
+        std::string temp_path = checkpoint_path + ".tmp";
+        int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if(fd < 0)
+        {
+            throw std::runtime_error("cannot create checkpoint: " + temp_path);
+        }
+        try
+        {
+            std::string records;
+            std::vector<Key_T> key_buf(checkpoint_chunk);
+            std::vector<Mapped_T> value_buf(checkpoint_chunk);
+            entries.scan_chunks(key_buf.data(), value_buf.data(), checkpoint_chunk,
+                [&](const Key_T *keys, const Mapped_T *values, size_t count)
+            {
+                records.clear();
+                for(size_t i = 0; i < count; i++)
+                {
+                    append_record(records, put_record, keys[i], &values[i]);
+                }
+                write_all(fd, records, temp_path);
+            });
+            sync_fd(fd, temp_path);
+        }
+        catch(...)
+        {
+            ::close(fd);
+            throw;
+        }
+        ::close(fd);
+        if(::rename(temp_path.c_str(), checkpoint_path.c_str()) != 0)
+        {
+            throw std::runtime_error("cannot install checkpoint: " + checkpoint_path);
+        }
+
+        //without this a crash could keep the old checkpoint beside the emptied log
+        sync_parent(checkpoint_path);
+
+        //the checkpoint now holds everything, so the log can start over
+        pending.clear();
+        if(::ftruncate(log_fd, 0) != 0 || ::lseek(log_fd, 0, SEEK_SET) < 0)
+        {
+            throw std::runtime_error("cannot reset log: " + log_path);
+        }
+        log_size = 0;
+    }
+
+    static const size_t checkpoint_chunk = 1024;
+};
+
+}
+
+#endif // DURABLEMAP_HPP_INCLUDED
@@ -7,34 +7,638 @@
 #include <vector>
 #include <cassert>
 #include <stdexcept>
+#include <algorithm>
+#include <type_traits>
+#include <string>
+#include <cstring>
+#include <cstdint>
+#include <thread>
+#include <atomic>
+#include <exception>
+#include <new>
+#include <mutex>
+#include <cstddef>
+#include <functional>
 
 namespace kanec1994
 {
 
-template<typename Key_T, typename Mapped_T>
+/*Storage for the key of a Map node. Keys live in their own heap block
+and the node holds a pointer to them.*/
+template<typename Key_T, bool Inline = std::is_arithmetic<Key_T>::value>
+struct KeySlot
+{
+    static const bool in_node = false;
+    Key_T *ptr;
+    template<typename K>
+    void create(const K &key)
+    {
+        ptr = new Key_T(key);
+    }
+    /*Free the key; heap is false when it was built in place by move_to*/
+    void destroy(bool heap = true)
+    {
+        if(heap)
+        {
+            delete ptr;
+        }
+        else
+        {
+            ptr->~Key_T();
+        }
+    }
+    /*Repoint this slot at a copy of its key built in where, moved if
+    by_move. The old key is left for its own slot to destroy.*/
+    void move_to(void *where, bool by_move)
+    {
+        ptr = by_move ? new(where) Key_T(std::move(*ptr)) : new(where) Key_T(*ptr);
+    }
+    /*Resync anything cached from the key after it was changed in place*/
+    void refresh()
+    {
+
+    }
+    Key_T &operator*() const
+    {
+        return *ptr;
+    }
+    const void *address() const
+    {
+        return ptr;
+    }
+};
+
+/*Arithmetic keys are stored inline in the node, so comparing against a
+node costs no extra pointer chase*/
+template<typename Key_T>
+struct KeySlot<Key_T, true>
+{
+    static const bool in_node = true;
+    Key_T key;
+    template<typename K>
+    void create(const K &k)
+    {
+        key = static_cast<Key_T>(k);
+    }
+    void destroy(bool = true)
+    {
+
+    }
+    void move_to(void *, bool)
+    {
+
+    }
+    void refresh()
+    {
+
+    }
+    Key_T &operator*()
+    {
+        return key;
+    }
+    const Key_T &operator*() const
+    {
+        return key;
+    }
+    const void *address() const
+    {
+        return &key;
+    }
+};
+
+/*std::string keys keep their first 8 bytes, packed big-endian so integer
+order matches string order, and their length in the node. Most compares
+are settled by those without touching the string's own buffer.*/
+template<>
+struct KeySlot<std::string, false>
+{
+    static const bool in_node = false;
+    uint64_t prefix;
+    size_t length;
+    std::string *ptr;
+    static uint64_t load_prefix(const char *data, size_t len)
+    {
+        uint64_t packed = 0;
+        for(size_t i = 0; i < 8; i++)
+        {
+            packed = (packed << 8) | (i < len ? static_cast<unsigned char>(data[i]) : 0);
+        }
+        return packed;
+    }
+    template<typename K>
+    void create(const K &key)
+    {
+        ptr = new std::string(key);
+        refresh();
+    }
+    void destroy(bool heap = true)
+    {
+        if(heap)
+        {
+            delete ptr;
+        }
+        else
+        {
+            ptr->~basic_string();
+        }
+    }
+    void move_to(void *where, bool)
+    {
+        ptr = new(where) std::string(std::move(*ptr));
+    }
+    /*Reload length and prefix, which go stale if the string is
+    assigned through a NodeHandle*/
+    void refresh()
+    {
+        length = ptr->size();
+        prefix = load_prefix(ptr->data(), length);
+    }
+    std::string &operator*() const
+    {
+        return *ptr;
+    }
+    const void *address() const
+    {
+        return &prefix;
+    }
+};
+
+/*Three-way compare of a lookup key against a node's KeySlot. Built once
+per lookup so any per-key setup is not repeated at every level.*/
+template<typename Slot, typename K>
+struct KeyProbe
+{
+    const K &key;
+    KeyProbe(const K &lookup) : key(lookup)
+    {
+
+    }
+    int compare(const Slot &slot) const
+    {
+        if(key < *slot)
+        {
+            return -1;
+        }
+        return *slot < key ? 1 : 0;
+    }
+};
+
+/*Probe for std::string slots: packs the lookup key's prefix once, then
+only reads the node's string when both prefixes match and both keys are
+longer than the prefix*/
+template<typename K>
+struct KeyProbe<KeySlot<std::string, false>, K>
+{
+    const char *data;
+    size_t length;
+    uint64_t prefix;
+    KeyProbe(const std::string &lookup)
+    {
+        init(lookup.data(), lookup.size());
+    }
+    KeyProbe(const char *lookup)
+    {
+        init(lookup, std::strlen(lookup));
+    }
+    template<typename S, typename = decltype(std::declval<const S &>().data(),
+        std::declval<const S &>().size())>
+    KeyProbe(const S &lookup)
+    {
+        init(lookup.data(), lookup.size());
+    }
+    void init(const char *lookup, size_t len)
+    {
+        data = lookup;
+        length = len;
+        prefix = KeySlot<std::string, false>::load_prefix(lookup, len);
+    }
+    int compare(const KeySlot<std::string, false> &slot) const
+    {
+        if(prefix != slot.prefix)
+        {
+            return prefix < slot.prefix ? -1 : 1;
+        }
+
+        //equal prefixes: if either key fits in the prefix it is a prefix of the other
+        if(length > 8 && slot.length > 8)
+        {
+            size_t common = length < slot.length ? length : slot.length;
+            int cmp = std::memcmp(data + 8, slot.ptr->data() + 8, common - 8);
+            if(cmp != 0)
+            {
+                return cmp < 0 ? -1 : 1;
+            }
+        }
+        if(length == slot.length)
+        {
+            return 0;
+        }
+        return length < slot.length ? -1 : 1;
+    }
+};
+
+/*Whether std::hash can hash T, which Map's membership filter needs*/
+template<typename T, typename = void>
+struct IsHashable : std::false_type
+{
+
+};
+template<typename T>
+struct IsHashable<T, decltype(std::hash<T>()(std::declval<const T &>()), void())> : std::true_type
+{
+
+};
+
+/*Value storage policies for Map. InlineValues keeps each value inside its
+tree node. SlabValues keeps only a pointer in the node and packs the
+values into separate slabs, so nodes stay small and lookups, which never
+read values, touch less memory. Map uses InlineValues unless told
+otherwise; pick SlabValues per Map for large values that lookups skip.*/
+struct InlineValues
+{
+
+};
+struct SlabValues
+{
+
+};
+/*Fixed-size slots for Mapped_T carved out of large chunks. Each slot
+records its chunk, so a value can be freed without its slab, even by
+another Map after extract, merge or split has moved its node there. Only
+the owning slab touches a chunk's local free list, so its own frees take
+no lock; frees from anywhere else go on the chunk's remote list under its
+mutex and are reclaimed once the local list runs dry. A chunk is freed
+once its slab and all of its values are gone.*/
+template<typename Mapped_T>
+class ValueSlab
+{
+private:
+    struct Chunk;
+    struct Slot
+    {
+        Chunk *chunk;
+        typename std::aligned_storage<sizeof(Mapped_T), alignof(Mapped_T)>::type storage;
+    };
+    struct Chunk
+    {
+        std::atomic<size_t> live;
+        std::atomic<const ValueSlab *> owner;
+        std::mutex lock;
+        Slot *local_free;
+        Slot *remote_free;
+        size_t used;
+        size_t capacity;
+        static Chunk *create(const ValueSlab *owner, size_t capacity)
+        {
+            Chunk *chunk = new(::operator new(header_bytes() + capacity * sizeof(Slot))) Chunk;
+            chunk->live = 1;
+            chunk->owner = owner;
+            chunk->local_free = nullptr;
+            chunk->remote_free = nullptr;
+            chunk->used = 0;
+            chunk->capacity = capacity;
+            return chunk;
+        }
+        static size_t header_bytes()
+        {
+            return (sizeof(Chunk) + alignof(Slot) - 1) / alignof(Slot) * alignof(Slot);
+        }
+        static void release(Chunk *chunk)
+        {
+            if(--chunk->live == 0)
+            {
+                chunk->~Chunk();
+                ::operator delete(chunk);
+            }
+        }
+        static Slot *&next_free(Slot *slot)
+        {
+            return *reinterpret_cast<Slot **>(&slot->storage);
+        }
+        /*Reuse a freed slot, else hand out the next unused one, reclaiming
+        the remote list only once both run out. Only the owning slab calls
+        this.*/
+        Slot *take()
+        {
+            if(local_free == nullptr && used == capacity)
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                local_free = remote_free;
+                remote_free = nullptr;
+            }
+            Slot *slot = local_free;
+            if(slot != nullptr)
+            {
+                local_free = next_free(slot);
+            }
+            else if(used < capacity)
+            {
+                slot = reinterpret_cast<Slot *>(reinterpret_cast<char *>(this) + header_bytes()) + used++;
+                slot->chunk = this;
+            }
+            else
+            {
+                return nullptr;
+            }
+            live++;
+            return slot;
+        }
+        /*Return slot, freed by the slab from: straight onto the local list
+        when from owns the chunk, else onto the remote list*/
+        void give_back(Slot *slot, const ValueSlab *from)
+        {
+            if(from != nullptr && owner.load(std::memory_order_relaxed) == from)
+            {
+                next_free(slot) = local_free;
+                local_free = slot;
+            }
+            else
+            {
+                std::lock_guard<std::mutex> guard(lock);
+                next_free(slot) = remote_free;
+                remote_free = slot;
+            }
+            release(this);
+        }
+    };
+    std::vector<Chunk *> chunks;
+    size_t current = 0;
+    static const size_t chunk_bytes = 64 * 1024;
+
+    /*Find a free slot, starting at the chunk that last had one and adding
+    a chunk once every existing one is full*/
+    Slot *take()
+    {
+        for(size_t tried = 0; tried < chunks.size(); tried++)
+        {
+            Slot *slot = chunks[current]->take();
+            if(slot != nullptr)
+            {
+                return slot;
+            }
+            current = current + 1 == chunks.size() ? 0 : current + 1;
+        }
+        size_t capacity = chunk_bytes / sizeof(Slot);
+        chunks.push_back(Chunk::create(this, capacity < 16 ? 16 : capacity));
+        current = chunks.size() - 1;
+        return chunks.back()->take();
+    }
+    static Slot *slot_of(Mapped_T *value)
+    {
+        return reinterpret_cast<Slot *>(reinterpret_cast<char *>(value) - offsetof(Slot, storage));
+    }
+public:
+    ValueSlab()
+    {
+
+    }
+    ValueSlab(const ValueSlab &) = delete;
+    ValueSlab &operator=(const ValueSlab &) = delete;
+    ~ValueSlab()
+    {
+        for(Chunk *chunk : chunks)
+        {
+            //values still out are freed as remote from here on
+            chunk->owner = nullptr;
+            Chunk::release(chunk);
+        }
+    }
+    template<typename... Args>
+    Mapped_T *create(Args&&... args)
+    {
+        Slot *slot = take();
+        try
+        {
+            return new(&slot->storage) Mapped_T(std::forward<Args>(args)...);
+        }
+        catch(...)
+        {
+            slot->chunk->give_back(slot, this);
+            throw;
+        }
+    }
+    /*Free value. from is the slab of the Map freeing it, or nullptr when
+    no Map is involved; either may differ from the slab value came from.*/
+    static void destroy(Mapped_T *value, const ValueSlab *from)
+    {
+        value->~Mapped_T();
+        Slot *slot = slot_of(value);
+        slot->chunk->give_back(slot, from);
+    }
+    /*Bytes held by this slab's chunks, used or not*/
+    size_t reserved_bytes() const
+    {
+        size_t total = 0;
+        for(Chunk *chunk : chunks)
+        {
+            total += Chunk::header_bytes() + chunk->capacity * sizeof(Slot);
+        }
+        return total;
+    }
+};
+
+/*Storage for the value of a Map node under a value policy. The value is
+built in place in the node.*/
+template<typename Mapped_T, typename Values>
+struct ValueSlot
+{
+    struct Slab
+    {
+
+    };
+    static const bool in_node = true;
+    mutable typename std::aligned_storage<sizeof(Mapped_T), alignof(Mapped_T)>::type storage;
+    template<typename... Args>
+    void create(Slab &, Args&&... args)
+    {
+        new(&storage) Mapped_T(std::forward<Args>(args)...);
+    }
+    void destroy(const Slab * = nullptr)
+    {
+        get()->~Mapped_T();
+    }
+    /*Build this slot's value from other's when compact() moves a node.
+    Afterwards other is released with moved_out.*/
+    void relocate_from(ValueSlot &other, bool by_move)
+    {
+        if(by_move)
+        {
+            new(&storage) Mapped_T(std::move(*other));
+        }
+        else
+        {
+            new(&storage) Mapped_T(*other);
+        }
+    }
+    void moved_out()
+    {
+        destroy();
+    }
+    Mapped_T *get() const
+    {
+        return reinterpret_cast<Mapped_T *>(&storage);
+    }
+    Mapped_T &operator*() const
+    {
+        return *get();
+    }
+};
+
+/*Slab policy: the node holds a pointer to a value living in its Map's
+ValueSlab. Values never move, even when compact() moves their node.*/
+template<typename Mapped_T>
+struct ValueSlot<Mapped_T, SlabValues>
+{
+    typedef ValueSlab<Mapped_T> Slab;
+    static const bool in_node = false;
+    Mapped_T *ptr;
+    template<typename... Args>
+    void create(Slab &slab, Args&&... args)
+    {
+        ptr = slab.create(std::forward<Args>(args)...);
+    }
+    void destroy(const Slab *from = nullptr)
+    {
+        Slab::destroy(ptr, from);
+    }
+    void relocate_from(ValueSlot &, bool)
+    {
+
+    }
+    void moved_out()
+    {
+
+    }
+    Mapped_T *get() const
+    {
+        return ptr;
+    }
+    Mapped_T &operator*() const
+    {
+        return *ptr;
+    }
+};
+
+template<typename Key_T, typename Mapped_T, typename Values = InlineValues>
 class Map
 {
+public:
+    /*Snapshot of tree shape and memory footprint returned by stats().
+    node_bytes, key_bytes and value_bytes are exact sizeof sums. slack_bytes
+    and total_bytes are estimates: each heap block is charged as glibc
+    malloc would size it (8 byte header, 16 byte rounding, 32 byte minimum),
+    so under another allocator they are approximate.*/
+    struct Stats
+    {
+        size_t size = 0;
+        size_t height = 0;
+        size_t black_height = 0;
+        size_t min_black_height = 0;
+        double average_depth = 0.0;
+        size_t max_depth = 0;
+        std::vector<size_t> depth_histogram;
+        size_t red_nodes = 0;
+        size_t node_bytes = 0;
+        size_t key_bytes = 0;
+        size_t value_bytes = 0;
+        size_t slack_bytes = 0;
+        size_t total_bytes = 0;
+    };
 private:
+    struct NodeBlock;
     struct RBNode
     {
         int color;
-        Key_T *key;
-        Mapped_T *value;
+        KeySlot<Key_T> key;
+        ValueSlot<Mapped_T, Values> value;
         struct RBNode *parent;
         struct RBNode *left;
         struct RBNode *right;
         struct RBNode *next;
         struct RBNode *prev;
+        struct NodeBlock *block;
+    };
+    /*A node relocated by compact() together with its key, unless the key
+    is stored inline. Inline values move with the node; slab values stay
+    put.*/
+    struct NodeCell
+    {
+        RBNode node;
+        typename std::conditional<KeySlot<Key_T>::in_node, char,
+            typename std::aligned_storage<sizeof(Key_T), alignof(Key_T)>::type>::type key;
+    };
+    /*Header of one contiguous run of NodeCells, filled in order by
+    compact(). live counts the cells still holding a node, plus one while
+    compact() is filling the block, and the block is freed when it hits 0.
+    It is atomic because extracted, merged or split nodes may be freed by
+    another Map.*/
+    struct NodeBlock
+    {
+        std::atomic<size_t> live;
+        size_t used;
+        size_t capacity;
+        static size_t header_bytes()
+        {
+            return (sizeof(NodeBlock) + alignof(NodeCell) - 1) / alignof(NodeCell) * alignof(NodeCell);
+        }
+        static NodeBlock *create(size_t capacity)
+        {
+            NodeBlock *block = new(::operator new(header_bytes() + capacity * sizeof(NodeCell))) NodeBlock;
+            block->live = 1;
+            block->used = 0;
+            block->capacity = capacity;
+            return block;
+        }
+        static void release(NodeBlock *block)
+        {
+            if(--block->live == 0)
+            {
+                block->~NodeBlock();
+                ::operator delete(block);
+            }
+        }
+        NodeCell *cells()
+        {
+            return reinterpret_cast<NodeCell *>(reinterpret_cast<char *>(this) + header_bytes());
+        }
     };
-    struct RBNode *first, *last;
+    struct RBNode *first = nullptr, *last = nullptr;
     typedef std::pair<const Key_T, Mapped_T> ValueType;
+    /*Enables a lookup overload for K only when K and Key_T can be
+    compared with operator< in both directions. Arithmetic K other than
+    Key_T itself is left to the Key_T overloads, so it is converted first
+    as before rather than compared with mixed-sign or narrowing rules.*/
+    template<typename K>
+    using Comparable = typename std::enable_if<!std::is_arithmetic<K>::value || std::is_same<K, Key_T>::value,
+        decltype(std::declval<const K &>() < std::declval<const Key_T &>(),
+        std::declval<const Key_T &>() < std::declval<const K &>(), void())>::type;
+    /*One buffered upsert or erase held by a WriteBatch*/
+    struct BatchOp
+    {
+        Key_T key;
+        Mapped_T value;
+        bool erase;
+    };
     class RBTree
     {
         private:
+            template<typename K>
+            using Probe = KeyProbe<KeySlot<Key_T>, K>;
             Map *owner;
             int black = 0, red = 1;
             struct RBNode *root;
             size_t num_nodes;
+            bool use_finger;
+            mutable RBNode *finger;
+            typename ValueSlot<Mapped_T, Values>::Slab slab;
+            bool use_filter;
+            std::vector<uint64_t> filter_words;
+            size_t filter_capacity;
+            size_t filter_erased;
+            bool compacting;
+            RBNode *compact_next;
+            size_t compact_moved;
+            NodeBlock *compact_block;
         public:
             /*RBTree constructor*/
             RBTree(Map *owned_by)
@@ -42,486 +646,1664 @@ private:
                 owner = owned_by;
                 root = nullptr;
                 num_nodes = 0;
+                use_finger = false;
+                finger = nullptr;
+                use_filter = false;
+                filter_capacity = 0;
+                filter_erased = 0;
+                compacting = false;
+                compact_next = nullptr;
+                compact_moved = 0;
+                compact_block = nullptr;
+            }
+            /*Turn implicit finger search on or off. While on, find_node and
+            find_slot start from the last node they reached.*/
+            void set_finger(bool enabled)
+            {
+                use_finger = enabled;
+                finger = nullptr;
+            }
+            /*Turn the membership filter on (building it from the current
+            keys) or off (freeing it)*/
+            void set_filter(bool enabled)
+            {
+                use_filter = enabled;
+                if(enabled)
+                {
+                    rebuild_filter();
+                }
+                else
+                {
+                    std::vector<uint64_t>().swap(filter_words);
+                    filter_capacity = 0;
+                }
+            }
+            /*Mix std::hash output, which is the identity for integers, so
+            every bit depends on the whole key*/
+            static uint64_t filter_hash(const Key_T &key, std::true_type)
+            {
+                uint64_t hash = static_cast<uint64_t>(std::hash<Key_T>()(key));
+                hash ^= hash >> 33;
+                hash *= 0xff51afd7ed558ccdULL;
+                hash ^= hash >> 33;
+                hash *= 0xc4ceb9fe1a85ec53ULL;
+                hash ^= hash >> 33;
+                return hash;
+            }
+            static uint64_t filter_hash(const Key_T &, std::false_type)
+            {
+                return 0;
+            }
+            /*The filter is a blocked Bloom filter: the low hash bits pick one
+            64 bit word and four 6 bit fields of the high bits pick the bits
+            to set in it, so a query reads a single cache line*/
+            static uint64_t filter_mask(uint64_t hash)
+            {
+                return (static_cast<uint64_t>(1) << ((hash >> 40) & 63))
+                    | (static_cast<uint64_t>(1) << ((hash >> 46) & 63))
+                    | (static_cast<uint64_t>(1) << ((hash >> 52) & 63))
+                    | (static_cast<uint64_t>(1) << ((hash >> 58) & 63));
+            }
+            void filter_add(const Key_T &key)
+            {
+                uint64_t hash = filter_hash(key, IsHashable<Key_T>());
+                filter_words[hash & (filter_words.size() - 1)] |= filter_mask(hash);
+            }
+            /*True only if key is certainly absent. Lookups by a K other than
+            Key_T are never filtered, since their hash may not match.*/
+            template<typename K>
+            bool filter_excludes(const K &) const
+            {
+                return false;
+            }
+            bool filter_excludes(const Key_T &key) const
+            {
+                if(!use_filter)
+                {
+                    return false;
+                }
+                uint64_t hash = filter_hash(key, IsHashable<Key_T>());
+                uint64_t mask = filter_mask(hash);
+                return (filter_words[hash & (filter_words.size() - 1)] & mask) != mask;
+            }
+            /*Size the filter for twice the current keys, 16 bits per key at
+            that size, and refill it. Erased keys cannot be cleared from a
+            Bloom filter, so it is also rebuilt once erases since the last
+            rebuild reach half its capacity; both keep upkeep amortized O(1).*/
+            void rebuild_filter()
+            {
+                filter_capacity = num_nodes * 2 < min_filter_keys ? min_filter_keys : num_nodes * 2;
+                size_t words = 1;
+                while(words * 4 < filter_capacity)
+                {
+                    words <<= 1;
+                }
+                filter_words.assign(words, 0);
+                for(RBNode *curr = owner->first; curr != nullptr; curr = curr->next)
+                {
+                    filter_add(*curr->key);
+                }
+                filter_erased = 0;
+            }
+            /*RBTree destructor*/
+            ~RBTree()
+            {
+                //frees every node in one walk of the threaded list
+                erase_nodes(owner->first, nullptr);
+                if(compact_block != nullptr)
+                {
+                    NodeBlock::release(compact_block);
+                }
+            }
+            void delete_map()
+            {
+                erase_nodes(owner->first, nullptr);
+            }
+            size_t size_tree() const
+            {
+                return num_nodes;
+            }
+            /*Bytes reserved by the value slab, if the Map has one*/
+            static size_t slab_bytes(const ValueSlab<Mapped_T> &values)
+            {
+                return values.reserved_bytes();
+            }
+            template<typename Slab>
+            static size_t slab_bytes(const Slab &)
+            {
+                return 0;
+            }
+            /*Bytes glibc malloc hands out for a request of n bytes on a 64 bit
+            target: an 8 byte chunk header rounded up to 16 byte granularity,
+            32 byte minimum. Other allocators differ, so this is a model.*/
+            static size_t alloc_bytes(size_t n)
+            {
+                size_t chunk = (n + 8 + 15) & ~static_cast<size_t>(15);
+                return chunk < 32 ? 32 : chunk;
+            }
+            /*Walk every node iteratively and fill in shape and memory stats*/
+            void collect_stats(Stats &out) const
+            {
+                out = Stats();
+                out.size = num_nodes;
+                if(root == nullptr)
+                {
+                    return;
+                }
+
+                //each entry holds a node, its depth and black nodes above it
+                std::vector<std::pair<RBNode *, std::pair<size_t, size_t>>> stack;
+                stack.push_back({root, {0, 0}});
+                size_t depth_sum = 0;
+                bool leaf_seen = false;
+                size_t heap_nodes = 0;
+                std::vector<NodeBlock *> blocks;
+                while(!stack.empty())
+                {
+                    RBNode *curr = stack.back().first;
+                    size_t depth = stack.back().second.first;
+                    size_t blacks = stack.back().second.second;
+                    stack.pop_back();
+
+                    if(curr->block == nullptr)
+                    {
+                        heap_nodes++;
+                    }
+                    else if(blocks.empty() || blocks.back() != curr->block)
+                    {
+                        blocks.push_back(curr->block);
+                    }
+
+                    if(curr->color == red)
+                    {
+                        out.red_nodes++;
+                    }
+                    else
+                    {
+                        blacks++;
+                    }
+                    if(out.depth_histogram.size() <= depth)
+                    {
+                        out.depth_histogram.resize(depth + 1, 0);
+                    }
+                    out.depth_histogram[depth]++;
+                    depth_sum += depth;
+                    if(depth > out.max_depth)
+                    {
+                        out.max_depth = depth;
+                    }
+
+                    //a missing child ends a root-to-leaf path
+                    if(curr->left == nullptr || curr->right == nullptr)
+                    {
+                        if(!leaf_seen || blacks < out.min_black_height)
+                        {
+                            out.min_black_height = blacks;
+                        }
+                        if(blacks > out.black_height)
+                        {
+                            out.black_height = blacks;
+                        }
+                        leaf_seen = true;
+                    }
+                    if(curr->left != nullptr)
+                    {
+                        stack.push_back({curr->left, {depth + 1, blacks}});
+                    }
+                    if(curr->right != nullptr)
+                    {
+                        stack.push_back({curr->right, {depth + 1, blacks}});
+                    }
+                }
+                out.height = out.max_depth + 1;
+                out.average_depth = static_cast<double>(depth_sum) / num_nodes;
+
+                //a node not yet compacted owns a heap block, plus one for its key
+                //unless the key is inline; a compacted node and its key share a
+                //cell of a NodeBlock, each block counted whole so that its dead
+                //and unfilled cells show up as slack. A block shared with another
+                //Map through extract, merge or split is counted by both. Values
+                //are either inline or in the slab's chunks.
+                const bool key_in_node = KeySlot<Key_T>::in_node;
+                const bool value_in_node = ValueSlot<Mapped_T, Values>::in_node;
+                out.key_bytes = num_nodes * sizeof(Key_T);
+                out.value_bytes = num_nodes * sizeof(Mapped_T);
+                out.node_bytes = num_nodes * sizeof(RBNode) - (key_in_node ? out.key_bytes : 0)
+                    - (value_in_node ? out.value_bytes : 0);
+                size_t allocated = heap_nodes * (alloc_bytes(sizeof(RBNode))
+                    + (key_in_node ? 0 : alloc_bytes(sizeof(Key_T)))) + slab_bytes(slab);
+                std::sort(blocks.begin(), blocks.end());
+                blocks.erase(std::unique(blocks.begin(), blocks.end()), blocks.end());
+                for(NodeBlock *block : blocks)
+                {
+                    allocated += alloc_bytes(NodeBlock::header_bytes() + block->capacity * sizeof(NodeCell));
+                }
+
+                //the membership filter's words, while it is on, are overhead too
+                if(filter_words.capacity() != 0)
+                {
+                    allocated += alloc_bytes(filter_words.capacity() * sizeof(uint64_t));
+                }
+                out.slack_bytes = allocated - out.node_bytes - out.key_bytes - out.value_bytes;
+                out.total_bytes = allocated + sizeof(Map);
+            }
+            /*Perform left rotation on selected node*/
+            void rotate_left(RBNode *&root, RBNode *&pivot)
+            {
+                RBNode *swap_node = pivot->right;
+
+                //if it exists, make swap_node subtree child of pivot
+                if(swap_node->left != nullptr)
+                {
+                    pivot->right = swap_node->left;
+                    swap_node->left->parent = pivot;
+                }
+                else
+                {
+                    pivot->right = nullptr;
+                }
+
+                //if pivot is root, make swap_node root, else handle rest of swap
+                if(pivot == root)
+                {
+                    swap_node->parent = nullptr;
+                    root = swap_node;
+                }
+                else
+                {
+                    swap_node->parent = pivot->parent;
+                    if(pivot == pivot->parent->left)
+                    {
+                        pivot->parent->left = swap_node;
+                    }
+                    else
+                    {
+                        pivot->parent->right = swap_node;
+                    }
+                }
+                pivot->parent = swap_node;
+                swap_node->left = pivot;
+            }
+            /*Perform right rotation on selected node*/
+            void rotate_right(RBNode *&root, RBNode *&pivot)
+            {
+                RBNode *swap_node = pivot->left;
+
+                //if it exists, make swap_node subtree child of pivot
+                if(swap_node->right != nullptr)
+                {
+                    pivot->left = swap_node->right;
+                    swap_node->right->parent = pivot;
+                }
+                else
+                {
+                    pivot->left = nullptr;
+                }
+
+                //if pivot is root, make swap_node root, else handle rest of swap
+                if(pivot == root)
+                {
+                    swap_node->parent = nullptr;
+                    root = swap_node;
+                }
+                else
+                {
+                    swap_node->parent = pivot->parent;
+                    if(pivot == pivot->parent->left)
+                    {
+                        pivot->parent->left = swap_node;
+                    }
+                    else
+                    {
+                        pivot->parent->right = swap_node;
+                    }
+                }
+                pivot->parent = swap_node;
+                swap_node->right = pivot;
+            }
+            /*Rebalance Red-Black tree*/
+            void fix_insert(RBNode *&root, RBNode *&node)
+            {
+                RBNode *parent = nullptr;
+                RBNode *grand_parent = nullptr;
+
+                //Continue looping while node != root, node is red, and parent color is red
+                while((node != root) && (node->color != black) && (node->parent->color == red))
+                {
+                    parent = node->parent;
+                    grand_parent = node->parent->parent;
+
+                    //all possible cases when parent of node is left child of grand_parent
+                    if(parent == grand_parent->left)
+                    {
+                        //recolor if uncle is red
+                        if(grand_parent->right != nullptr && grand_parent->right->color == red)
+                        {
+                            parent->color = black;
+                            grand_parent->right->color = black;
+                            grand_parent->color = red;
+                            node = grand_parent;
+                        }
+                        //perform cases when uncle is black
+                        else
+                        {
+                            int temp_color;
+
+                            //left-right case: left rotation of parent needed
+                            if(node == parent->right)
+                            {
+                                rotate_left(root, parent);
+                                node = parent;
+                                parent = node->parent;
+                            }
+
+                            //left-left case: right rotation of grand_parent and color swap
+                            rotate_right(root, grand_parent);
+                            temp_color = grand_parent->color;
+                            grand_parent->color = parent->color;
+                            parent->color = temp_color;
+                            node = parent;
+                        }
+                    }
+                    else
+                    {
+                        //recolor if uncle is red
+                        if(grand_parent->left != nullptr && grand_parent->left->color == red)
+                        {
+                            parent->color = black;
+                            grand_parent->left->color = black;
+                            grand_parent->color = red;
+                            node = grand_parent;
+                        }
+                        //perform cases when uncle is black
+                        else
+                        {
+                            int temp_color;
+
+                            //right-left case: right rotation of parent needed
+                             if(node == parent->left)
+                            {
+                                rotate_right(root, parent);
+                                node = parent;
+                                parent = node->parent;
+                            }
+
+                            //right-right case: left rotation of grand_parent and color swap
+                            rotate_left(root, grand_parent);
+                            temp_color = grand_parent->color;
+                            grand_parent->color = parent->color;
+                            parent->color = temp_color;
+                            node = parent;
+                        }
+                    }
+                    //If current node is root, change color to black
+                    if(node == root)
+                    {
+                        node->color = black;
+                    }
+                }
+            }
+
+            /*Rebalance Red-Black tree after removing a black node. node
+            (possibly nullptr) is one black short and hangs from parent.*/
+            void fix_delete(RBNode *node, RBNode *parent)
+            {
+                while(node != root && (node == nullptr || node->color == black))
+                {
+                    RBNode *sibling;
+
+                    //all possible cases when node is left child of parent
+                    if(node == parent->left)
+                    {
+                        sibling = parent->right;
+
+                        //red sibling: rotate so the sibling is black
+                        if(sibling->color == red)
+                        {
+                            sibling->color = black;
+                            parent->color = red;
+                            rotate_left(root, parent);
+                            sibling = parent->right;
+                        }
+
+                        //both nephews black: recolor and move the deficit up
+                        if((sibling->left == nullptr || sibling->left->color == black)
+                            && (sibling->right == nullptr || sibling->right->color == black))
+                        {
+                            sibling->color = red;
+                            node = parent;
+                            parent = node->parent;
+                        }
+                        else
+                        {
+                            //right-left case: right rotation of sibling needed
+                            if(sibling->right == nullptr || sibling->right->color == black)
+                            {
+                                sibling->left->color = black;
+                                sibling->color = red;
+                                rotate_right(root, sibling);
+                                sibling = parent->right;
+                            }
+
+                            //right-right case: left rotation of parent ends the fixup
+                            sibling->color = parent->color;
+                            parent->color = black;
+                            sibling->right->color = black;
+                            rotate_left(root, parent);
+                            node = root;
+                        }
+                    }
+                    else
+                    {
+                        sibling = parent->left;
+
+                        //red sibling: rotate so the sibling is black
+                        if(sibling->color == red)
+                        {
+                            sibling->color = black;
+                            parent->color = red;
+                            rotate_right(root, parent);
+                            sibling = parent->left;
+                        }
+
+                        //both nephews black: recolor and move the deficit up
+                        if((sibling->left == nullptr || sibling->left->color == black)
+                            && (sibling->right == nullptr || sibling->right->color == black))
+                        {
+                            sibling->color = red;
+                            node = parent;
+                            parent = node->parent;
+                        }
+                        else
+                        {
+                            //left-right case: left rotation of sibling needed
+                            if(sibling->left == nullptr || sibling->left->color == black)
+                            {
+                                sibling->right->color = black;
+                                sibling->color = red;
+                                rotate_left(root, sibling);
+                                sibling = parent->left;
+                            }
+
+                            //left-left case: right rotation of parent ends the fixup
+                            sibling->color = parent->color;
+                            parent->color = black;
+                            sibling->left->color = black;
+                            rotate_right(root, parent);
+                            node = root;
+                        }
+                    }
+                }
+                if(node != nullptr)
+                {
+                    node->color = black;
+                }
+            }
+            /*Allocate an unlinked red node holding a Key_T built from key
+            and a Mapped_T built from args*/
+            template<typename K, typename... Args>
+            RBNode *create_node(const K &key, Args&&... args)
+            {
+                RBNode *new_node = new RBNode();
+                try
+                {
+                    new_node->key.create(key);
+                }
+                catch(...)
+                {
+                    delete new_node;
+                    throw;
+                }
+                try
+                {
+                    new_node->value.create(slab, std::forward<Args>(args)...);
+                }
+                catch(...)
+                {
+                    new_node->key.destroy();
+                    delete new_node;
+                    throw;
+                }
+                new_node->left = nullptr;
+                new_node->right = nullptr;
+                new_node->parent = nullptr;
+                new_node->next = nullptr;
+                new_node->prev = nullptr;
+                new_node->block = nullptr;
+                new_node->color = red;
+                return new_node;
+            }
+            /*Free a node along with its key and value. from is the freeing
+            Map's value slab, or nullptr for a node held by no Map.*/
+            static void destroy_node(RBNode *node,
+                const typename ValueSlot<Mapped_T, Values>::Slab *from = nullptr)
+            {
+                node->key.destroy(node->block == nullptr);
+                node->value.destroy(from);
+                free_node(node);
+            }
+            /*Give back the memory of a node whose key and value are gone*/
+            static void free_node(RBNode *node)
+            {
+                if(node->block == nullptr)
+                {
+                    delete node;
+                }
+                else
+                {
+                    NodeBlock::release(node->block);
+                }
+            }
+            /*Drop cached pointers to node before it leaves the tree*/
+            void forget_node(RBNode *node)
+            {
+                if(finger == node)
+                {
+                    finger = nullptr;
+                }
+                if(compact_next == node)
+                {
+                    compact_next = node->next;
+                }
+            }
+            /*Descend to key. Returns the matching node, or nullptr with
+            curr_parent and left set to where a node for key would hang*/
+            template<typename K>
+            RBNode *find_slot(const K &key, RBNode *&curr_parent, bool &left) const
+            {
+                if(use_finger)
+                {
+                    RBNode *found = find_slot_near(finger, key, curr_parent, left);
+                    finger = found != nullptr ? found : curr_parent;
+                    return found;
+                }
+                return find_slot_from(root, key, curr_parent, left);
+            }
+            /*find_slot for the subtree under start, which must be able to
+            hold key*/
+            template<typename K>
+            RBNode *find_slot_from(RBNode *start, const K &key, RBNode *&curr_parent, bool &left) const
+            {
+                Probe<K> probe(key);
+                RBNode *curr = start;
+                curr_parent = nullptr;
+                left = false;
+                while(curr != nullptr)
+                {
+                    int cmp = probe.compare(curr->key);
+                    if(cmp < 0)
+                    {
+                        curr_parent = curr;
+                        left = true;
+                        curr = curr->left;
+                    }
+                    else if(cmp > 0)
+                    {
+                        curr_parent = curr;
+                        left = false;
+                        curr = curr->right;
+                    }
+                    else
+                    {
+                        return curr;
+                    }
+                }
+                return nullptr;
+            }
+            /*Finger search: find_slot starting from near, a node reached
+            by an earlier access, in O(log d) for a key d entries away. Walks
+            a few steps along next/prev first, since the slot between two
+            neighbours is always a free child of one of them. Otherwise it
+            climbs parents until the subtree can hold key and descends.*/
+            template<typename K>
+            RBNode *find_slot_near(RBNode *near, const K &key, RBNode *&curr_parent, bool &left) const
+            {
+                if(near == nullptr)
+                {
+                    return find_slot_from(root, key, curr_parent, left);
+                }
+                Probe<K> probe(key);
+                int cmp = probe.compare(near->key);
+                if(cmp == 0)
+                {
+                    return near;
+                }
+
+                //walk the threaded list looking for the gap that holds key
+                RBNode *curr = near;
+                for(int step = 0; step < finger_steps; step++)
+                {
+                    //only step to a neighbour that is an ancestor, and so was
+                    //on the path to curr, rather than one deep in a subtree
+                    if((cmp > 0 ? curr->right : curr->left) != nullptr)
+                    {
+                        break;
+                    }
+                    RBNode *neighbor = cmp > 0 ? curr->next : curr->prev;
+                    int neighbor_cmp = neighbor == nullptr ? -cmp : probe.compare(neighbor->key);
+                    if(neighbor_cmp == 0)
+                    {
+                        return neighbor;
+                    }
+                    if((neighbor_cmp > 0) != (cmp > 0))
+                    {
+                        RBNode *lower = cmp > 0 ? curr : neighbor;
+                        RBNode *upper = cmp > 0 ? neighbor : curr;
+                        if(lower != nullptr && lower->right == nullptr)
+                        {
+                            curr_parent = lower;
+                            left = false;
+                        }
+                        else
+                        {
+                            curr_parent = upper;
+                            left = true;
+                        }
+                        return nullptr;
+                    }
+                    curr = neighbor;
+                }
+
+                //climb until the key falls between curr's subtree and its parent
+                while(curr->parent != nullptr)
+                {
+                    RBNode *parent = curr->parent;
+                    if((parent->left == curr) == (cmp > 0))
+                    {
+                        int parent_cmp = probe.compare(parent->key);
+                        if(parent_cmp == 0)
+                        {
+                            return parent;
+                        }
+                        if((parent_cmp < 0) == (cmp > 0))
+                        {
+                            break;
+                        }
+                    }
+                    curr = parent;
+                }
+                return find_slot_from(curr, key, curr_parent, left);
+            }
+            /*Hang an unlinked node at the slot found by find_slot, thread
+            it into the next/prev list and rebalance*/
+            void link_node(RBNode *curr, RBNode *curr_parent, bool left)
+            {
+                curr->left = nullptr;
+                curr->right = nullptr;
+                curr->parent = curr_parent;
+                curr->next = nullptr;
+                curr->prev = nullptr;
+                curr->color = red;
+
+                //if root does not already exist, curr becomes root
+                if(curr_parent == nullptr)
+                {
+                    root = curr;
+                    root->color = black;
+                    owner->first = curr;
+                    owner->last = curr;
+                }
+                else
+                {
+                    //curr to be inserted as curr_parent left child
+                    if(left)
+                    {
+                        curr_parent->left = curr;
+                        curr->next = curr_parent;
+                        curr->prev = curr_parent->prev;
+                        if(curr_parent->prev == nullptr)
+                        {
+                            curr_parent->prev = curr;
+                            owner->first = curr;
+                        }
+                        else
+                        {
+                            curr_parent->prev->next = curr;
+                            curr_parent->prev = curr;
+                        }
+                    }
+                    //curr to be inserted as curr_parent right child
+                    else
+                    {
+                        curr_parent->right = curr;
+                        curr->prev = curr_parent;
+                        curr->next = curr_parent->next;
+                        if(curr_parent->next == nullptr)
+                        {
+                            curr_parent->next = curr;
+                            owner->last = curr;
+                        }
+                        else
+                        {
+                            curr_parent->next->prev = curr;
+                            curr_parent->next = curr;
+                        }
+                    }
+                    //fix_insert walks its node argument up the tree, so give it a copy
+                    RBNode *fixup = curr;
+                    fix_insert(root, fixup);
+                }
+                num_nodes++;
+                if(use_finger)
+                {
+                    finger = curr;
+                }
+                if(use_filter)
+                {
+                    if(num_nodes > filter_capacity)
+                    {
+                        rebuild_filter();
+                    }
+                    else
+                    {
+                        filter_add(*curr->key);
+                    }
+                }
+            }
+            std::pair<RBNode *, bool> insert_node(Key_T key, Mapped_T value)
+            {
+                RBNode *curr_parent;
+                bool left;
+                RBNode *found = find_slot(key, curr_parent, left);
+                if(found != nullptr)
+                {
+                    return {found, false};
+                }
+
+                //create new_node only once the key is known to be absent
+                RBNode *new_node = create_node(key, value);
+                link_node(new_node, curr_parent, left);
+                return {new_node, true};
+            }
+            /*Find key or insert it with a Mapped_T built from args, in a
+            single descent. args are only used when a node is created.*/
+            template<typename K, typename... Args>
+            std::pair<RBNode *, bool> emplace_node(const K &key, Args&&... args)
+            {
+                RBNode *curr_parent;
+                bool left;
+                RBNode *found = find_slot(key, curr_parent, left);
+                if(found != nullptr)
+                {
+                    return {found, false};
+                }
+                RBNode *new_node = create_node(key, std::forward<Args>(args)...);
+                link_node(new_node, curr_parent, left);
+                return {new_node, true};
             }
-            /*RBTree destructor*/
-            ~RBTree()
+            /*Link a node detached from this or another tree back in without
+            reallocating. Fails if its key is already present. The key may
+            have been changed through its NodeHandle, so its cached parts are
+            reloaded first.*/
+            std::pair<RBNode *, bool> insert_existing(RBNode *node)
             {
-                //calls delete on nodes until no nodes remaining
-                while(root != nullptr)
+                node->key.refresh();
+                RBNode *curr_parent;
+                bool left;
+                RBNode *found = find_slot(*node->key, curr_parent, left);
+                if(found != nullptr)
                 {
-                    delete_node(*root->key);
+                    return {found, false};
                 }
+                link_node(node, curr_parent, left);
+                return {node, true};
             }
-            void delete_map()
+            /*Find the node matching key and free it. K may be any type
+            that compares with Key_T through operator<.*/
+            template<typename K>
+            bool delete_node(const K &key)
             {
-                while(root != nullptr)
+                RBNode *curr = find_node(key);
+
+                //If node not in tree, return appropriate response
+                if(curr == nullptr)
                 {
-                    delete_node(*root->key);
+                    return false;
                 }
+                detach_node(curr);
+                destroy_node(curr, &slab);
+                return true;
             }
-            size_t size_tree() const
+            /*Put node where old hangs from old's parent, or make it root*/
+            void replace_child(RBNode *old, RBNode *node)
             {
-                return num_nodes;
+                if(old->parent == nullptr)
+                {
+                    root = node;
+                }
+                else if(old->parent->left == old)
+                {
+                    old->parent->left = node;
+                }
+                else
+                {
+                    old->parent->right = node;
+                }
+                if(node != nullptr)
+                {
+                    node->parent = old->parent;
+                }
             }
-            /*Perform left rotation on selected node*/
-            void rotate_left(RBNode *&root, RBNode *&pivot)
+            /*Free the nodes from begin up to but not including end (nullptr
+            for the end of the list) and return how many were freed. A run of
+            k nodes with k log n < n is detached one node at a time, O(1)
+            amortized each; a longer one is cut out of the threaded list whole
+            and the tree is rebuilt once in O(n).*/
+            size_t erase_nodes(RBNode *begin, RBNode *end)
             {
-                RBNode *swap_node = pivot->right;
-
-                //if it exists, make swap_node subtree child of pivot
-                if(swap_node->left != nullptr)
+                size_t count = 0;
+                for(RBNode *curr = begin; curr != end; curr = curr->next)
                 {
-                    pivot->right = swap_node->left;
-                    swap_node->left->parent = pivot;
+                    count++;
                 }
-                else
+                if(count == 0)
                 {
-                    pivot->right = nullptr;
+                    return 0;
                 }
 
-                //if pivot is root, make swap_node root, else handle rest of swap
-                if(*pivot->key == *root->key)
+                size_t log_n = 1;
+                while((static_cast<size_t>(1) << log_n) <= num_nodes)
                 {
-                    swap_node->parent = nullptr;
-                    root = swap_node;
+                    log_n++;
                 }
-                else
+                if(count * log_n < num_nodes)
                 {
-                    swap_node->parent = pivot->parent;
-                    if(pivot->parent->left != nullptr && *pivot->key == *pivot->parent->left->key)
-                    {
-                        pivot->parent->left = swap_node;
-                    }
-                    else
+                    while(begin != end)
                     {
-                        pivot->parent->right = swap_node;
+                        RBNode *next = begin->next;
+                        detach_node(begin);
+                        destroy_node(begin, &slab);
+                        begin = next;
                     }
+                    return count;
                 }
-                pivot->parent = swap_node;
-                swap_node->left = pivot;
-            }
-            /*Perform right rotation on selected node*/
-            void rotate_right(RBNode *&root, RBNode *&pivot)
-            {
-                RBNode *swap_node = pivot->left;
 
-                //if it exists, make swap_node subtree child of pivot
-                if(swap_node->right != nullptr)
+                //splice the run out of the list, then free it
+                finger = nullptr;
+                RBNode *before = begin->prev;
+                if(before == nullptr)
                 {
-                    pivot->left = swap_node->right;
-                    swap_node->right->parent = pivot;
+                    owner->first = end;
                 }
                 else
                 {
-                    pivot->left = nullptr;
+                    before->next = end;
                 }
-
-                //if pivot is root, make swap_node root, else handle rest of swap
-                if(*pivot->key == *root->key)
+                if(end == nullptr)
                 {
-                    swap_node->parent = nullptr;
-                    root = swap_node;
+                    owner->last = before;
                 }
                 else
                 {
-                    swap_node->parent = pivot->parent;
-                    if(pivot->parent->left != nullptr && *pivot->key == *pivot->parent->left->key)
-                    {
-                        pivot->parent->left = swap_node;
-                    }
-                    else
-                    {
-                        pivot->parent->right = swap_node;
-                    }
+                    end->prev = before;
                 }
-                pivot->parent = swap_node;
-                swap_node->right = pivot;
+                while(begin != end)
+                {
+                    RBNode *next = begin->next;
+                    forget_node(begin);
+                    destroy_node(begin, &slab);
+                    begin = next;
+                }
+                num_nodes -= count;
+                build_balanced();
+                return count;
             }
-            /*Rebalance Red-Black tree*/
-            void fix_insert(RBNode *&root, RBNode *&node)
+            /*Number of threads to use when the caller asks for threads
+            (0 means one per hardware thread)*/
+            static unsigned worker_count(unsigned threads)
             {
-                RBNode *parent = nullptr;
-                RBNode *grand_parent = nullptr;
-
-                //Continue looping while node != root, node is red, and parent color is red
-                while((*node->key != *root->key) && (node->color != black) && (node->parent->color == red))
+                if(threads == 0)
                 {
-                    parent = node->parent;
-                    grand_parent = node->parent->parent;
-
-                    //all possible cases when parent of node is left child of grand_parent
-                    if(grand_parent->left != nullptr && *parent->key == *grand_parent->left->key)
+                    threads = std::thread::hardware_concurrency();
+                }
+                return threads == 0 ? 1 : threads;
+            }
+            /*Cut the threaded list into about runs_per_worker runs per
+            worker by taking every node above a fixed depth as a boundary.
+            Each run is one boundary node plus the subtree between it and
+            the next boundary, so starts[i] up to starts[i + 1] (nullptr
+            after the last) covers the tree in order.*/
+            void split_ranges(unsigned workers, std::vector<RBNode *> &starts) const
+            {
+                starts.clear();
+                if(root == nullptr)
+                {
+                    return;
+                }
+                size_t levels = 0;
+                while((static_cast<size_t>(1) << levels) < workers * runs_per_worker)
+                {
+                    levels++;
+                }
+                starts.push_back(owner->first);
+                collect_boundaries(root, 0, levels, starts);
+            }
+            void collect_boundaries(RBNode *node, size_t depth, size_t levels,
+                std::vector<RBNode *> &starts) const
+            {
+                if(node == nullptr || depth >= levels)
+                {
+                    return;
+                }
+                collect_boundaries(node->left, depth + 1, levels, starts);
+                if(node != starts.back())
+                {
+                    starts.push_back(node);
+                }
+                collect_boundaries(node->right, depth + 1, levels, starts);
+            }
+            /*Run task(i, starts[i], end of run i) for every run on workers
+            threads, the caller's included. Workers claim the next unclaimed
+            run from a shared counter, so a worker stuck on a slow run does
+            not hold up the rest. The first exception thrown is rethrown.*/
+            template<typename Task>
+            void run_ranges(unsigned workers, const std::vector<RBNode *> &starts, Task task) const
+            {
+                std::atomic<size_t> next_run(0);
+                std::exception_ptr error;
+                std::atomic<bool> failed(false);
+                auto work = [&]()
+                {
+                    size_t index;
+                    while(!failed && (index = next_run++) < starts.size())
                     {
-                        //recolor if uncle is red
-                        if(grand_parent->right != nullptr && grand_parent->right->color == red)
+                        RBNode *range_end = index + 1 < starts.size() ? starts[index + 1] : nullptr;
+                        try
                         {
-                            parent->color = black;
-                            grand_parent->right->color = black;
-                            grand_parent->color = red;
-                            node = grand_parent;
+                            task(index, starts[index], range_end);
                         }
-                        //perform cases when uncle is black
-                        else
+                        catch(...)
                         {
-                            int temp_color;
-
-                            //left-right case: left rotation of parent needed
-                            if(parent->right != nullptr && *node->key == *parent->right->key)
+                            if(!failed.exchange(true))
                             {
-                                rotate_left(root, parent);
-                                node = parent;
-                                parent = node->parent;
+                                error = std::current_exception();
                             }
-
-                            //left-left case: right rotation of grand_parent and color swap
-                            rotate_right(root, grand_parent);
-                            temp_color = grand_parent->color;
-                            grand_parent->color = parent->color;
-                            parent->color = temp_color;
-                            node = parent;
                         }
                     }
+                };
+
+                std::vector<std::thread> pool;
+                size_t helpers = workers < starts.size() ? workers - 1 : starts.size() - (starts.empty() ? 0 : 1);
+                for(size_t i = 0; i < helpers; i++)
+                {
+                    pool.emplace_back(work);
+                }
+                work();
+                for(std::thread &worker : pool)
+                {
+                    worker.join();
+                }
+                if(error)
+                {
+                    std::rethrow_exception(error);
+                }
+            }
+            /*Detach node, if any, and return it for a NodeHandle to own*/
+            RBNode *extract_node(RBNode *node)
+            {
+                if(node != nullptr)
+                {
+                    detach_node(node);
+                }
+                return node;
+            }
+            /*Unlink curr from the tree and the threaded list without
+            freeing it*/
+            void detach_node(RBNode *curr)
+            {
+                forget_node(curr);
+                RBNode *child;
+                RBNode *child_parent;
+                int removed_color;
+
+                //Node has at most 1 child: splice the child into its place
+                if(curr->left == nullptr || curr->right == nullptr)
+                {
+                    child = curr->left != nullptr ? curr->left : curr->right;
+                    child_parent = curr->parent;
+                    removed_color = curr->color;
+                    replace_child(curr, child);
+                }
+                //Node has 2 children: largest RBNode in left subtree takes its place,
+                //which is its list predecessor, so no walk down is needed
+                else
+                {
+                    RBNode *replacement = curr->prev;
+                    removed_color = replacement->color;
+                    child = replacement->left;
+
+                    if(replacement->parent == curr)
+                    {
+                        child_parent = replacement;
+                    }
                     else
                     {
-                        //recolor if uncle is red
-                        if(grand_parent->left != nullptr && grand_parent->left->color == red)
-                        {
-                            parent->color = black;
-                            grand_parent->left->color = black;
-                            grand_parent->color = red;
-                            node = grand_parent;
-                        }
-                        //perform cases when uncle is black
-                        else
-                        {
-                            int temp_color;
+                        child_parent = replacement->parent;
+                        replace_child(replacement, child);
+                        replacement->left = curr->left;
+                        curr->left->parent = replacement;
+                    }
+                    replace_child(curr, replacement);
+                    replacement->right = curr->right;
+                    curr->right->parent = replacement;
+                    replacement->color = curr->color;
+                }
 
-                            //right-left case: right rotation of parent needed
-                             if(parent->left != nullptr && *node->key == *parent->left->key)
-                            {
-                                rotate_right(root, parent);
-                                node = parent;
-                                parent = node->parent;
-                            }
+                //removing a black node shortens one side, so restore black heights
+                if(removed_color == black)
+                {
+                    fix_delete(child, child_parent);
+                }
 
-                            //right-right case: left rotation of grand_parent and color swap
-                            rotate_left(root, grand_parent);
-                            temp_color = grand_parent->color;
-                            grand_parent->color = parent->color;
-                            parent->color = temp_color;
-                            node = parent;
-                        }
-                    }
-                    //If current node is root, change color to black
-                    if(*node->key == *root->key)
+                if(root == nullptr)
+                {
+                    owner->first = nullptr;
+                    owner->last = nullptr;
+                }
+                else if(curr->prev == nullptr)
+                {
+                    curr->next->prev = nullptr;
+                    owner->first = curr->next;
+                }
+                else if(curr->next == nullptr)
+                {
+                    curr->prev->next = nullptr;
+                    owner->last = curr->prev;
+                }
+                else
+                {
+                    curr->next->prev = curr->prev;
+                    curr->prev->next = curr->next;
+                }
+                num_nodes--;
+                if(use_filter && ++filter_erased > filter_capacity / 2)
+                {
+                    rebuild_filter();
+                }
+            }
+            /*Move node into the next free cell of block, key and value
+            included, and point its neighbours at the new copy. Keys and
+            values are moved when both moves are noexcept and copied
+            otherwise, so a throwing copy leaves node untouched.*/
+            void relocate_node(RBNode *node, NodeBlock *block)
+            {
+                const bool by_move = std::is_nothrow_move_constructible<Key_T>::value
+                    && std::is_nothrow_move_constructible<Mapped_T>::value;
+                NodeCell *cell = block->cells() + block->used;
+                RBNode *moved = new(&cell->node) RBNode(*node);
+                moved->value.relocate_from(node->value, by_move);
+                try
+                {
+                    moved->key.move_to(&cell->key, by_move);
+                }
+                catch(...)
+                {
+                    if(ValueSlot<Mapped_T, Values>::in_node)
                     {
-                        node->color = black;
+                        moved->value.destroy();
                     }
+                    throw;
+                }
+                moved->block = block;
+                block->used++;
+                block->live++;
+
+                replace_child(node, moved);
+                if(moved->left != nullptr)
+                {
+                    moved->left->parent = moved;
+                }
+                if(moved->right != nullptr)
+                {
+                    moved->right->parent = moved;
+                }
+                if(moved->prev == nullptr)
+                {
+                    owner->first = moved;
+                }
+                else
+                {
+                    moved->prev->next = moved;
+                }
+                if(moved->next == nullptr)
+                {
+                    owner->last = moved;
+                }
+                else
+                {
+                    moved->next->prev = moved;
+                }
+                if(finger == node)
+                {
+                    finger = moved;
                 }
+                node->key.destroy(node->block == nullptr);
+                node->value.moved_out();
+                free_node(node);
             }
+            /*Relocate up to budget nodes (0 for no limit) in key order into
+            contiguous NodeBlocks, resuming where the last call stopped.
+            Nodes inserted behind the resume point stay where they are. Once
+            every node is moved the call that finishes relinks the whole tree
+            balanced over the new storage, an O(n) pass that allocates
+            nothing, and returns true.*/
+            bool compact_step(size_t budget)
+            {
+                if(!compacting)
+                {
+                    if(root == nullptr)
+                    {
+                        return true;
+                    }
+                    compacting = true;
+                    compact_next = owner->first;
+                    compact_moved = 0;
+                }
+                for(size_t steps = 0; compact_next != nullptr && (budget == 0 || steps < budget); steps++)
+                {
+                    if(compact_block == nullptr || compact_block->used == compact_block->capacity)
+                    {
+                        //size the block for the nodes still to go, as far as is known
+                        size_t remaining = num_nodes > compact_moved ? num_nodes - compact_moved : 0;
+                        if(compact_block != nullptr)
+                        {
+                            NodeBlock::release(compact_block);
+                            compact_block = nullptr;
+                        }
+                        compact_block = NodeBlock::create(remaining < min_block ? min_block : remaining);
+                    }
+                    RBNode *next = compact_next->next;
+                    relocate_node(compact_next, compact_block);
+                    compact_next = next;
+                    compact_moved++;
+                }
+                if(compact_next != nullptr)
+                {
+                    return false;
+                }
 
-            /*Performed iteratively in order to keep track of red
-            and black node colors*/
-            std::pair<RBNode *, bool> insert_node(Key_T key, Mapped_T value)
+                if(compact_block != nullptr)
+                {
+                    NodeBlock::release(compact_block);
+                    compact_block = nullptr;
+                }
+                compacting = false;
+
+                //relocation leaves the key set alone, so the filter stays valid
+                build_balanced(false);
+                return true;
+            }
+            /*Relink the threaded list from owner->first into a perfectly
+            balanced tree in O(n). Nodes on an incomplete bottom level are
+            colored red and all others black, which keeps it a valid
+            Red-Black tree. keys_changed is false when the same keys were
+            only moved, so the membership filter need not be rebuilt.*/
+            void build_balanced(bool keys_changed = true)
             {
-                //create new_node to be inserted
-                RBNode *new_node = new RBNode();
-                new_node->key = new Key_T(key);
-                new_node->value = new Mapped_T(value);
-                new_node->left = nullptr;
-                new_node->right = nullptr;
-                new_node->parent = nullptr;
-                new_node->next = nullptr;
-                new_node->prev = nullptr;
-                new_node->color = red;
+                size_t levels = 0;
+                while((static_cast<size_t>(1) << levels) - 1 < num_nodes)
+                {
+                    levels++;
+                }
+                size_t red_depth = num_nodes == (static_cast<size_t>(1) << levels) - 1
+                    ? levels : levels - 1;
+                RBNode *cursor = owner->first;
+                root = build_range(cursor, num_nodes, 0, red_depth);
+                if(root != nullptr)
+                {
+                    root->parent = nullptr;
+                }
+                if(use_filter && keys_changed)
+                {
+                    rebuild_filter();
+                }
+            }
+            /*Build a subtree from the next count list nodes starting at cursor*/
+            RBNode *build_range(RBNode *&cursor, size_t count, size_t depth, size_t red_depth)
+            {
+                if(count == 0)
+                {
+                    return nullptr;
+                }
+                size_t left_count = (count - 1) / 2;
+                RBNode *left_child = build_range(cursor, left_count, depth + 1, red_depth);
+                RBNode *node = cursor;
+                cursor = cursor->next;
+                RBNode *right_child = build_range(cursor, count - 1 - left_count, depth + 1, red_depth);
 
-                //if root does not already exist, new_node becomes root
-                if(root == nullptr)
+                node->left = left_child;
+                node->right = right_child;
+                if(left_child != nullptr)
+                {
+                    left_child->parent = node;
+                }
+                if(right_child != nullptr)
                 {
-                    root = new_node;
-                    root->color = black;
-                    owner->first = new_node;
-                    owner->last = new_node;
+                    right_child->parent = node;
                 }
-                else
+                node->color = depth == red_depth ? red : black;
+                return node;
+            }
+            /*Apply key-sorted, duplicate-free ops. Batches small next to the
+            tree go through insert_node/delete_node one at a time; larger ones
+            are merged into the threaded list in one pass and the tree is then
+            rebuilt once with build_balanced. If a Mapped_T copy throws the Map
+            keeps its old keys, though values already overwritten stay so.*/
+            void apply_sorted(const std::vector<BatchOp> &ops)
+            {
+                size_t log_n = 1;
+                while((static_cast<size_t>(1) << log_n) <= num_nodes)
                 {
-                    //find place to insert new_node
-                    RBNode *curr = root;
-                    RBNode *curr_parent = nullptr;
-                    while(curr != nullptr)
+                    log_n++;
+                }
+                if(ops.size() * log_n < num_nodes)
+                {
+                    for(const BatchOp &op : ops)
                     {
-                        if(key < *curr->key)
-                        {
-                            curr_parent = curr;
-                            curr = curr->left;
-                        }
-                        else if(*curr->key < key)
+                        if(op.erase)
                         {
-                            curr_parent = curr;
-                            curr = curr->right;
+                            delete_node(op.key);
                         }
                         else
                         {
-                            return {curr, false};
+                            std::pair<RBNode *, bool> ret = insert_node(op.key, op.value);
+                            if(!ret.second)
+                            {
+                                *ret.first->value = op.value;
+                            }
                         }
                     }
+                    return;
+                }
 
-                    curr = new_node;
-                    //curr to be inserted as curr_parent left child
-                    if(key < *curr_parent->key)
+                //first build every new node and assign every overwritten value,
+                //leaving the list alone, so a throwing Mapped_T leaves a whole Map
+                RBNode *curr = owner->first;
+                RBNode *fresh = nullptr;
+                RBNode *fresh_tail = nullptr;
+                try
+                {
+                    for(const BatchOp &op : ops)
                     {
-                        curr_parent->left = curr;
-                        curr->parent = curr_parent;
-                        curr->next = curr_parent;
-                        curr->prev = curr_parent->prev;
-                        if(curr_parent->prev == nullptr)
-                        {
-                            curr_parent->prev = curr;
-                            owner->first = curr;
-                        }
-                        else
+                        while(curr != nullptr && *curr->key < op.key)
                         {
-                            curr_parent->prev->next = curr;
-                            curr_parent->prev = curr;
+                            curr = curr->next;
                         }
-                    }
-                    //curr to be inserted as curr_parent right child
-                    else if(*curr_parent->key < key)
-                    {
-                        curr_parent->right = curr;
-                        curr->parent = curr_parent;
-                        curr->prev = curr_parent;
-                        curr->next = curr_parent->next;
-                        if(curr_parent->next == nullptr)
+                        if(curr != nullptr && !(op.key < *curr->key))
                         {
-                            curr_parent->next = curr;
-                            owner->last = curr;
+                            if(!op.erase)
+                            {
+                                *curr->value = op.value;
+                            }
                         }
-                        else
+                        else if(!op.erase)
                         {
-                            curr_parent->next->prev = curr;
-                            curr_parent->next = curr;
+                            append_node(fresh, fresh_tail, create_node(op.key, op.value));
                         }
                     }
-                    fix_insert(root, curr);
                 }
-                num_nodes++;
-                return {new_node, true};
-            }
-            /*Performed iteratively in order to keep track of red
-            and black node colors*/
-            bool delete_node(Key_T key)
-            {
-                //Find node to be deleted
-                bool left;
-                RBNode *curr = root;
-                RBNode *curr_parent = nullptr;
-                while(curr != nullptr)
+                catch(...)
                 {
-                    if(*curr->key == key)
-                    {
-                        break;
-                    }
-                    else if(key < *curr->key)
-                    {
-                        left = true;
-                        curr_parent = curr;
-                        curr = curr->left;
-                    }
-                    else
+                    while(fresh != nullptr)
                     {
-                        left = false;
-                        curr_parent = curr;
-                        curr = curr->right;
+                        RBNode *next = fresh->next;
+                        destroy_node(fresh, &slab);
+                        fresh = next;
                     }
+                    throw;
                 }
 
-                //If node not in tree, return appropriate response
-                if(curr == nullptr)
+                //then merge them in, chaining erased nodes through next to be
+                //freed only once the new list and tree are in place
+                curr = owner->first;
+                RBNode *head = nullptr;
+                RBNode *tail = nullptr;
+                RBNode *erased = nullptr;
+                for(const BatchOp &op : ops)
                 {
-                    return false;
-                }
-                //Case 1: Node has no children
-                if(curr->left == nullptr && curr->right == nullptr)
-                {
-                    //Handle root node
-                    if(curr_parent == nullptr)
+                    //carry over untouched nodes ahead of op.key
+                    while(curr != nullptr && *curr->key < op.key)
                     {
-                        root = nullptr;
+                        RBNode *next = curr->next;
+                        append_node(head, tail, curr);
+                        curr = next;
                     }
-                    //Handle case when child is a leaf
-                    else
+
+                    if(curr != nullptr && !(op.key < *curr->key))
                     {
-                        if(left)
+                        RBNode *next = curr->next;
+                        if(op.erase)
                         {
-                            curr_parent->left = nullptr;
+                            forget_node(curr);
+                            curr->next = erased;
+                            erased = curr;
+                            num_nodes--;
                         }
                         else
                         {
-                            curr_parent->right = nullptr;
+                            append_node(head, tail, curr);
                         }
+                        curr = next;
+                    }
+                    else if(!op.erase)
+                    {
+                        RBNode *next = fresh->next;
+                        append_node(head, tail, fresh);
+                        fresh = next;
+                        num_nodes++;
                     }
                 }
-                //Case 2: Node has 1 child
-                else if(curr->left == nullptr || curr->right == nullptr)
+
+                //the rest of the list is unchanged, so splice it on whole
+                if(curr != nullptr)
                 {
-                    //Handle case when current node is the root
-                    if(curr_parent == nullptr)
+                    curr->prev = tail;
+                    if(tail == nullptr)
                     {
-                        if(curr->left == nullptr)
-                        {
-                            curr->right->parent = nullptr;
-                            root = curr->right;
-                        }
-                        else
-                        {
-                            curr->left->parent = nullptr;
-                            root = curr->left;
-                        }
+                        head = curr;
                     }
-                    //Handle all other cases of nodes with 1 child
                     else
                     {
-                        if(curr->left == nullptr)
-                        {
-                            if(left)
-                            {
-                                curr->right->parent = curr_parent;
-                                curr_parent->left = curr->right;
-                            }
-                            else
-                            {
-                                curr->right->parent = curr_parent;
-                                curr_parent->right = curr->right;
-                            }
-                        }
-                        else
-                        {
-                            if(left)
-                            {
-                                curr->left->parent = curr_parent;
-                                curr_parent->left = curr->left;
-                            }
-                            else
-                            {
-                                curr->left->parent = curr_parent;
-                                curr_parent->right = curr->left;
-                            }
-                        }
+                        tail->next = curr;
                     }
                 }
-                //Case 3: Node has 2 children
                 else
                 {
-                    //get largest RBNode in left subtree
-                    RBNode *replacement = curr->left;
-                    while(replacement->right != nullptr)
+                    if(tail != nullptr)
                     {
-                        replacement = replacement->right;
+                        tail->next = nullptr;
                     }
-
-                    //Handle all dependencies of replacing node to be deleted
-                    if(replacement->parent != curr)
+                    owner->last = tail;
+                }
+                owner->first = head;
+                build_balanced();
+                while(erased != nullptr)
+                {
+                    RBNode *next = erased->next;
+                    destroy_node(erased, &slab);
+                    erased = next;
+                }
+            }
+            /*Move every node of src whose key is absent here into this tree,
+            relinking rather than reallocating. Nodes with clashing keys stay
+            in src. Large merges zip both threaded lists together and rebuild
+            each tree once instead of relinking node by node.*/
+            void merge_from(RBTree &src)
+            {
+                size_t log_n = 1;
+                while((static_cast<size_t>(1) << log_n) <= num_nodes)
+                {
+                    log_n++;
+                }
+                if(src.num_nodes * log_n < num_nodes + src.num_nodes)
+                {
+                    RBNode *curr = src.owner->first;
+                    while(curr != nullptr)
                     {
-                        if(replacement->left != nullptr)
+                        RBNode *next = curr->next;
+                        RBNode *curr_parent;
+                        bool left;
+                        if(find_slot(*curr->key, curr_parent, left) == nullptr)
                         {
-                            replacement->left->parent = replacement->parent;
-                            replacement->parent->right = replacement->left;
+                            src.detach_node(curr);
+                            link_node(curr, curr_parent, left);
                         }
-                        else
-                        {
-                            replacement->parent->right = nullptr;
-                        }
-                        replacement->left = curr->left;
-                        replacement->right = curr->right;
-                        curr->left->parent = replacement;
-                        curr->right->parent = replacement;
+                        curr = next;
                     }
-                    else
+                    return;
+                }
+
+                RBNode *mine = owner->first;
+                RBNode *theirs = src.owner->first;
+                RBNode *head = nullptr, *tail = nullptr;
+                RBNode *src_head = nullptr, *src_tail = nullptr;
+                size_t moved = 0;
+                while(mine != nullptr || theirs != nullptr)
+                {
+                    if(theirs == nullptr || (mine != nullptr && *mine->key < *theirs->key))
                     {
-                        replacement->right = curr->right;
-                        curr->right->parent = replacement;
+                        RBNode *next = mine->next;
+                        append_node(head, tail, mine);
+                        mine = next;
                     }
-
-                    if(curr_parent == nullptr)
+                    else if(mine == nullptr || *theirs->key < *mine->key)
                     {
-                        replacement->parent = nullptr;
-                        root = replacement;
+                        RBNode *next = theirs->next;
+                        src.forget_node(theirs);
+                        append_node(head, tail, theirs);
+                        theirs = next;
+                        moved++;
                     }
                     else
                     {
-                        replacement->parent = curr_parent;
-                        if(left)
-                        {
-                            curr_parent->left = replacement;
-                        }
-                        else
-                        {
-                            curr->parent->right = replacement;
-                        }
-
+                        //key already here, so the src node stays behind
+                        RBNode *next = theirs->next;
+                        append_node(src_head, src_tail, theirs);
+                        theirs = next;
                     }
-
-                    //delete selected node
-
                 }
-                if(root == nullptr)
+                if(tail != nullptr)
+                {
+                    tail->next = nullptr;
+                }
+                if(src_tail != nullptr)
+                {
+                    src_tail->next = nullptr;
+                }
+                owner->first = head;
+                owner->last = tail;
+                src.finger = nullptr;
+                src.owner->first = src_head;
+                src.owner->last = src_tail;
+                num_nodes += moved;
+                src.num_nodes -= moved;
+                build_balanced();
+                src.build_balanced();
+            }
+            /*Move from and every node after it into dest, which must be
+            empty, by cutting the threaded list in two and rebuilding both
+            trees. O(n) with no allocation.*/
+            void split_to(RBNode *from, RBTree &dest)
+            {
+                if(from == nullptr)
+                {
+                    return;
+                }
+                size_t moved = 0;
+                for(RBNode *curr = from; curr != nullptr; curr = curr->next)
+                {
+                    forget_node(curr);
+                    moved++;
+                }
+
+                RBNode *before = from->prev;
+                dest.owner->first = from;
+                dest.owner->last = owner->last;
+                from->prev = nullptr;
+                owner->last = before;
+                if(before == nullptr)
                 {
                     owner->first = nullptr;
-                    owner->last = nullptr;
                 }
-                else if(curr->prev == nullptr)
+                else
                 {
-                    curr->next->prev = nullptr;
-                    owner->first = curr->next;
+                    before->next = nullptr;
                 }
-                else if(curr->next == nullptr)
+                finger = nullptr;
+                num_nodes -= moved;
+                dest.num_nodes = moved;
+                build_balanced();
+                dest.build_balanced();
+            }
+            /*Replace the contents with entries from a strictly ascending
+            range in O(n): nodes are threaded in order, then build_balanced
+            shapes the tree once. Throws if the range is not ascending.*/
+            template<typename IT_T>
+            void assign_sorted(IT_T range_beg, IT_T range_end)
+            {
+                erase_nodes(owner->first, nullptr);
+                RBNode *head = nullptr;
+                RBNode *tail = nullptr;
+                size_t count = 0;
+                try
                 {
-                    curr->prev->next = nullptr;
-                    owner->last = curr->prev;
+                    for(IT_T it = range_beg; it != range_end; ++it)
+                    {
+                        if(tail != nullptr && !(*tail->key < (*it).first))
+                        {
+                            throw std::invalid_argument("assign_sorted needs strictly ascending keys");
+                        }
+                        append_node(head, tail, create_node((*it).first, (*it).second));
+                        count++;
+                    }
+                }
+                catch(...)
+                {
+                    //nothing is linked into the tree yet, so free the list directly
+                    while(head != nullptr)
+                    {
+                        RBNode *next = head->next;
+                        destroy_node(head, &slab);
+                        head = next;
+                    }
+                    throw;
+                }
+                num_nodes = count;
+                owner->first = head;
+                owner->last = tail;
+                build_balanced();
+            }
+            /*Link node after tail in a list being rebuilt*/
+            static void append_node(RBNode *&head, RBNode *&tail, RBNode *node)
+            {
+                node->prev = tail;
+                if(tail == nullptr)
+                {
+                    head = node;
                 }
                 else
                 {
-                    curr->next->prev = curr->prev;
-                    curr->prev->next = curr->next;
+                    tail->next = node;
                 }
-                delete curr->key;
-                delete curr->value;
-                delete curr;
-                num_nodes--;
-                return true;
+                tail = node;
+            }
+            /*Lookups below accept any K comparable with Key_T through
+            operator< in both directions, so no Key_T is built per call*/
+            template<typename K>
+            Mapped_T &find_val(const K &key)
+            {
+                RBNode *curr = find_node(key);
+                if(curr == nullptr)
+                {
+                    throw std::out_of_range("Item not in Map");
+                }
+                return *curr->value;
+            }
+            template<typename K>
+            const Mapped_T &find_val(const K &key) const
+            {
+                RBNode *curr = find_node(key);
+                if(curr == nullptr)
+                {
+                    throw std::out_of_range("Item not in Map");
+                }
+                return *curr->value;
+            }
+            template<typename K>
+            RBNode *find_node(const K &key) const
+            {
+                if(filter_excludes(key))
+                {
+                    return nullptr;
+                }
+                if(use_finger)
+                {
+                    RBNode *curr_parent;
+                    bool left;
+                    RBNode *found = find_slot_near(finger, key, curr_parent, left);
+                    finger = found != nullptr ? found : curr_parent;
+                    return found;
+                }
+                return find_node(key, std::integral_constant<bool,
+                    std::is_arithmetic<Key_T>::value && std::is_arithmetic<K>::value>());
+            }
+            /*Branchless descent for arithmetic keys: never stop early, just
+            track the last node not less than key and test it at the bottom.
+            Picking the child is a conditional move rather than a branch the
+            CPU would mispredict about half the time on random lookups.*/
+            template<typename K>
+            RBNode *find_node(const K &key, std::true_type) const
+            {
+                RBNode *curr = root;
+                RBNode *found = nullptr;
+                while(curr != nullptr)
+                {
+                    bool go_right = *curr->key < key;
+                    found = go_right ? found : curr;
+                    curr = go_right ? curr->right : curr->left;
+                }
+                if(found != nullptr && key < *found->key)
+                {
+                    return nullptr;
+                }
+                return found;
             }
-            Mapped_T &find_val(const Key_T &key)
+            template<typename K>
+            RBNode *find_node(const K &key, std::false_type) const
             {
+                Probe<K> probe(key);
                 RBNode *curr = root;
                 while(curr != nullptr)
                 {
-                    if(*curr->key == key)
+                    int cmp = probe.compare(curr->key);
+                    if(cmp < 0)
                     {
-                        return *curr->value;
+                        curr = curr->left;
                     }
-                    else if(key < *curr->key)
+                    else if(cmp > 0)
                     {
-                        curr = curr->left;
+                        curr = curr->right;
                     }
                     else
                     {
-                        curr = curr->right;
+                        return curr;
                     }
                 }
-                throw std::out_of_range("Item not in Map");
+                return nullptr;
             }
-            RBNode *find_node(const Key_T &key)
+            /*First node whose key is not less than key*/
+            template<typename K>
+            RBNode *lower_bound_node(const K &key) const
             {
+                Probe<K> probe(key);
                 RBNode *curr = root;
+                RBNode *found = nullptr;
                 while(curr != nullptr)
                 {
-                    if(*curr->key == key)
+                    if(probe.compare(curr->key) > 0)
                     {
-                        return curr;
+                        curr = curr->right;
                     }
-                    else if(key < *curr->key)
+                    else
+                    {
+                        found = curr;
+                        curr = curr->left;
+                    }
+                }
+                return found;
+            }
+            /*First node whose key is greater than key*/
+            template<typename K>
+            RBNode *upper_bound_node(const K &key) const
+            {
+                Probe<K> probe(key);
+                RBNode *curr = root;
+                RBNode *found = nullptr;
+                while(curr != nullptr)
+                {
+                    if(probe.compare(curr->key) < 0)
                     {
+                        found = curr;
                         curr = curr->left;
                     }
                     else
@@ -529,16 +2311,207 @@ private:
                         curr = curr->right;
                     }
                 }
-                return nullptr;
+                return found;
+            }
+            /*Hint the cache to start loading a node before it is compared*/
+            static void prefetch(const void *addr)
+            {
+#if defined(__GNUC__) || defined(__clang__)
+                __builtin_prefetch(addr);
+#else
+                (void)addr;
+#endif
+            }
+            /*Look up n keys at once, writing the matching node (or nullptr)
+            for keys[i] into out[i]. Sorted batches reuse the path of the
+            previous key when they cover a good share of the tree, other
+            batches interleave several descents.*/
+            void find_nodes(const Key_T *keys, size_t n, RBNode **out) const
+            {
+                if(n >= merge_batch && n * 4 >= num_nodes && std::is_sorted(keys, keys + n))
+                {
+                    find_nodes_sorted(keys, n, out);
+                }
+                else
+                {
+                    for(size_t i = 0; i < n; i += lanes)
+                    {
+                        size_t batch = n - i < lanes ? n - i : lanes;
+                        find_nodes_interleaved(keys + i, batch, out + i);
+                    }
+                }
+            }
+            /*Advance up to lanes descents in lock step. Each lane alternates
+            between prefetching the key of the node it reached and comparing
+            against it, so one lane's cache misses overlap the others' work.*/
+            void find_nodes_interleaved(const Key_T *keys, size_t n, RBNode **out) const
+            {
+                RBNode *curr[lanes];
+                bool key_ready[lanes];
+                size_t active = n;
+                for(size_t i = 0; i < n; i++)
+                {
+                    curr[i] = root;
+                    key_ready[i] = false;
+                    out[i] = nullptr;
+                    if(root == nullptr)
+                    {
+                        active--;
+                    }
+                }
+
+                while(active > 0)
+                {
+                    for(size_t i = 0; i < n; i++)
+                    {
+                        RBNode *node = curr[i];
+                        if(node == nullptr)
+                        {
+                            continue;
+                        }
+                        if(!key_ready[i])
+                        {
+                            prefetch(node->key.address());
+                            key_ready[i] = true;
+                            continue;
+                        }
+
+                        //compare, then step to the child and start loading it
+                        key_ready[i] = false;
+                        if(keys[i] < *node->key)
+                        {
+                            node = node->left;
+                        }
+                        else if(*node->key < keys[i])
+                        {
+                            node = node->right;
+                        }
+                        else
+                        {
+                            out[i] = node;
+                            node = nullptr;
+                        }
+                        curr[i] = node;
+                        if(node == nullptr)
+                        {
+                            active--;
+                        }
+                        else
+                        {
+                            prefetch(node);
+                        }
+                    }
+                }
+            }
+            /*Ascending keys: keep the root-to-node path of the previous
+            lookup and only back up as far as the first ancestor whose
+            subtree can still hold the next key, then descend from there*/
+            void find_nodes_sorted(const Key_T *keys, size_t n, RBNode **out) const
+            {
+                //each entry holds a path node and the nearest ancestor it is left of
+                std::vector<std::pair<RBNode *, RBNode *>> path;
+                if(root != nullptr)
+                {
+                    path.push_back({root, nullptr});
+                }
+                for(size_t i = 0; i < n; i++)
+                {
+                    out[i] = nullptr;
+                    if(path.empty())
+                    {
+                        continue;
+                    }
+                    while(path.size() > 1 && path.back().second != nullptr
+                        && !(keys[i] < *path.back().second->key))
+                    {
+                        path.pop_back();
+                    }
+
+                    RBNode *curr = path.back().first;
+                    while(true)
+                    {
+                        RBNode *child;
+                        RBNode *bound;
+                        if(keys[i] < *curr->key)
+                        {
+                            child = curr->left;
+                            bound = curr;
+                        }
+                        else if(*curr->key < keys[i])
+                        {
+                            child = curr->right;
+                            bound = path.back().second;
+                        }
+                        else
+                        {
+                            out[i] = curr;
+                            break;
+                        }
+                        if(child == nullptr)
+                        {
+                            break;
+                        }
+                        path.push_back({child, bound});
+                        curr = child;
+                    }
+                }
             }
+            static const size_t lanes = 8;
+            static const int finger_steps = 4;
+            static const unsigned runs_per_worker = 8;
+            static const size_t merge_batch = 32;
+            static const size_t min_block = 64;
+            static const size_t min_filter_keys = 64;
     };
-    RBTree Curr_Map = RBTree(this);
-    Mapped_T mapped;
+    RBTree Curr_Map{this};
+    /*Fill the chunk buffers from range_beg up to range_end, prefetching
+    the node after next and its value while the current one is copied*/
+    template<typename Fn>
+    static size_t scan_nodes(RBNode *range_beg, RBNode *range_end, Key_T *key_buf,
+        Mapped_T *value_buf, size_t buffer_size, Fn &fn)
+    {
+        size_t total = 0;
+        size_t count = 0;
+        if(buffer_size == 0)
+        {
+            return 0;
+        }
+        for(RBNode *curr = range_beg; curr != range_end; curr = curr->next)
+        {
+            if(curr->next != nullptr && curr->next->next != nullptr)
+            {
+                RBTree::prefetch(curr->next->next);
+                RBTree::prefetch(curr->next->value.get());
+            }
+            if(key_buf != nullptr)
+            {
+                key_buf[count] = *curr->key;
+            }
+            if(value_buf != nullptr)
+            {
+                value_buf[count] = *curr->value;
+            }
+            count++;
+            if(count == buffer_size)
+            {
+                fn(static_cast<const Key_T *>(key_buf), static_cast<const Mapped_T *>(value_buf), count);
+                total += count;
+                count = 0;
+            }
+        }
+        if(count > 0)
+        {
+            fn(static_cast<const Key_T *>(key_buf), static_cast<const Mapped_T *>(value_buf), count);
+            total += count;
+        }
+        return total;
+    }
 public:
     class ConstIterator;
     class Iterator
     {
     private:
+        friend class Map;
         RBNode *target;
         Map *owner;
     public:
@@ -859,6 +2832,164 @@ public:
         }
     };
 
+    /*Owns a node taken out of a Map by extract(). It can be handed to
+    insert() on any Map of the same type without copying or reallocating
+    the key and value. A node still held when the handle dies is freed.*/
+    class NodeHandle
+    {
+    private:
+        friend class Map;
+        RBNode *node = nullptr;
+        NodeHandle(RBNode *extracted)
+        {
+            node = extracted;
+        }
+    public:
+        NodeHandle()
+        {
+
+        }
+        NodeHandle(NodeHandle &&other)
+        {
+            node = other.node;
+            other.node = nullptr;
+        }
+        NodeHandle &operator=(NodeHandle &&other)
+        {
+            if(this != &other)
+            {
+                if(node != nullptr)
+                {
+                    RBTree::destroy_node(node);
+                }
+                node = other.node;
+                other.node = nullptr;
+            }
+            return *this;
+        }
+        NodeHandle(const NodeHandle &) = delete;
+        NodeHandle &operator=(const NodeHandle &) = delete;
+        ~NodeHandle()
+        {
+            if(node != nullptr)
+            {
+                RBTree::destroy_node(node);
+            }
+        }
+        bool empty() const
+        {
+            return node == nullptr;
+        }
+        Key_T &key() const
+        {
+            return *node->key;
+        }
+        Mapped_T &mapped() const
+        {
+            return *node->value;
+        }
+    };
+
+    /*Remembers the last entry it reached so the next find or insert can
+    start there instead of at the root, costing O(log d) for a key d
+    entries away. Erasing the entry a Cursor is on leaves it dangling;
+    call reset() after erasing through anything other than the Cursor.*/
+    class Cursor
+    {
+    private:
+        Map *owner;
+        RBNode *finger = nullptr;
+    public:
+        Cursor(Map &map)
+        {
+            owner = &map;
+        }
+        /*Return a pointer to the value stored for key, or nullptr*/
+        Mapped_T *find(const Key_T &key)
+        {
+            return find<Key_T>(key);
+        }
+        template<typename K, typename = Comparable<K>>
+        Mapped_T *find(const K &key)
+        {
+            RBNode *curr_parent;
+            bool left;
+            RBNode *found = owner->Curr_Map.find_slot_near(finger, key, curr_parent, left);
+            finger = found != nullptr ? found : curr_parent;
+            return found == nullptr ? nullptr : found->value.get();
+        }
+        /*Insert key with value unless key is present. Returns a pointer to
+        the stored value and whether it was inserted.*/
+        std::pair<Mapped_T *, bool> insert(const Key_T &key, const Mapped_T &value)
+        {
+            RBNode *curr_parent;
+            bool left;
+            RBNode *found = owner->Curr_Map.find_slot_near(finger, key, curr_parent, left);
+            if(found != nullptr)
+            {
+                finger = found;
+                return {found->value.get(), false};
+            }
+            finger = owner->Curr_Map.create_node(key, value);
+            owner->Curr_Map.link_node(finger, curr_parent, left);
+            return {finger->value.get(), true};
+        }
+        /*Erase key if present, leaving the Cursor on a neighbour*/
+        bool erase(const Key_T &key)
+        {
+            return erase<Key_T>(key);
+        }
+        template<typename K, typename = Comparable<K>>
+        bool erase(const K &key)
+        {
+            RBNode *curr_parent;
+            bool left;
+            RBNode *found = owner->Curr_Map.find_slot_near(finger, key, curr_parent, left);
+            if(found == nullptr)
+            {
+                finger = curr_parent;
+                return false;
+            }
+            finger = found->next != nullptr ? found->next : found->prev;
+            owner->Curr_Map.erase_nodes(found, found->next);
+            return true;
+        }
+        void reset()
+        {
+            finger = nullptr;
+        }
+    };
+
+    /*Buffers upserts and erases so they can be applied to a Map in one
+    sorted pass. When a key is written more than once the last op wins.*/
+    class WriteBatch
+    {
+    private:
+        friend class Map;
+        std::vector<BatchOp> ops;
+    public:
+        void put(const Key_T &key, const Mapped_T &value)
+        {
+            ops.push_back({key, value, false});
+        }
+        void erase(const Key_T &key)
+        {
+            ops.push_back({key, Mapped_T(), true});
+        }
+        size_t size() const
+        {
+            return ops.size();
+        }
+        bool empty() const
+        {
+            return ops.empty();
+        }
+        void clear()
+        {
+            ops.clear();
+        }
+    };
+
     /*Map Class member functions begin here*/
     Map()
     {
@@ -900,6 +3031,139 @@ public:
     {
         return Curr_Map.size_tree() == 0;
     }
+    /*Call fn(key, value) for every entry, spread over threads workers
+    (0 means one per hardware thread). The tree is cut into many more
+    in-order runs than workers and each worker takes the next unclaimed
+    run, so uneven fn costs still balance. Within a run entries are visited
+    in key order, but runs are visited concurrently in any order, so fn
+    must be safe to call from several threads at once. The Map must not be
+    modified meanwhile. The first exception thrown by fn is rethrown here.*/
+    template<typename Fn>
+    void parallel_for_each(Fn fn, unsigned threads = 0)
+    {
+        unsigned workers = RBTree::worker_count(threads);
+        std::vector<RBNode *> starts;
+        Curr_Map.split_ranges(workers, starts);
+        Curr_Map.run_ranges(workers, starts, [&](size_t, RBNode *range_beg, RBNode *range_end)
+        {
+            for(RBNode *curr = range_beg; curr != range_end; curr = curr->next)
+            {
+                fn(static_cast<const Key_T &>(*curr->key), *curr->value);
+            }
+        });
+    }
+    /*Fold every entry into one T. map_fn(key, value) turns each entry into
+    a T and combine(a, b) joins two of them. combine must be associative.
+    Partial results are joined in key order starting from init, so combine
+    does not need to be commutative. Threads and safety are as for
+    parallel_for_each.*/
+    template<typename T, typename MapFn, typename CombineFn>
+    T parallel_reduce(T init, MapFn map_fn, CombineFn combine, unsigned threads = 0) const
+    {
+        unsigned workers = RBTree::worker_count(threads);
+        std::vector<RBNode *> starts;
+        Curr_Map.split_ranges(workers, starts);
+        //wrapped so T = bool does not become the bit-packed vector<bool>,
+        //whose elements workers could not write concurrently
+        struct Partial
+        {
+            T value;
+        };
+        std::vector<Partial> partial(starts.size(), Partial{init});
+        Curr_Map.run_ranges(workers, starts, [&](size_t index, RBNode *range_beg, RBNode *range_end)
+        {
+            const RBNode *curr = range_beg;
+            T acc = map_fn(static_cast<const Key_T &>(*curr->key),
+                static_cast<const Mapped_T &>(*curr->value));
+            for(curr = curr->next; curr != range_end; curr = curr->next)
+            {
+                acc = combine(acc, map_fn(static_cast<const Key_T &>(*curr->key),
+                    static_cast<const Mapped_T &>(*curr->value)));
+            }
+            partial[index].value = acc;
+        });
+
+        T result = init;
+        for(const Partial &part : partial)
+        {
+            result = combine(result, part.value);
+        }
+        return result;
+    }
+    /*Copy entries with lo <= key < hi into the caller's buffers, up to
+    buffer_size at a time, and call fn(keys, values, count) on each filled
+    chunk so it can run a tight loop over contiguous arrays. Pass nullptr
+    for key_buf or value_buf to copy only values or only keys; fn then gets
+    nullptr for that array. Returns the number of entries scanned.*/
+    template<typename Fn>
+    size_t scan_chunks(const Key_T &lo, const Key_T &hi, Key_T *key_buf, Mapped_T *value_buf,
+        size_t buffer_size, Fn fn) const
+    {
+        return scan_chunks<Key_T, Fn>(lo, hi, key_buf, value_buf, buffer_size, fn);
+    }
+    template<typename K, typename Fn, typename = Comparable<K>>
+    size_t scan_chunks(const K &lo, const K &hi, Key_T *key_buf, Mapped_T *value_buf,
+        size_t buffer_size, Fn fn) const
+    {
+        RBNode *range_beg = Curr_Map.lower_bound_node(lo);
+        RBNode *range_end = Curr_Map.lower_bound_node(hi);
+
+        //hi <= lo is detected through Key_T, as in erase_range
+        if(range_end != nullptr && *range_end->key < lo)
+        {
+            return 0;
+        }
+        return scan_nodes(range_beg, range_end, key_buf, value_buf, buffer_size, fn);
+    }
+    /*scan_chunks over the whole Map*/
+    template<typename Fn>
+    size_t scan_chunks(Key_T *key_buf, Mapped_T *value_buf, size_t buffer_size, Fn fn) const
+    {
+        return scan_nodes(first, nullptr, key_buf, value_buf, buffer_size, fn);
+    }
+    /*Opt in to implicit finger search: every keyed lookup, insert and
+    erase starts from the entry the previous one reached rather than from
+    the root. Pays off when consecutive keys are close together. While on,
+    const lookups update the finger too, so they must not run concurrently.*/
+    void set_finger_search(bool enabled)
+    {
+        Curr_Map.set_finger(enabled);
+    }
+    /*Relocate entries, in key order, into contiguous blocks holding each
+    node next to its key and value, then rebuild a perfectly balanced tree
+    over them, restoring the locality of a freshly built Map. Moves at most
+    max_nodes entries per call (0 for no limit) so the copying can be spread
+    over many calls with other operations in between. The call that moves
+    the last entry also relinks the whole tree, an O(n) pass over the
+    pointers that allocates and copies nothing, and returns true. Entries
+    inserted behind the point reached are left as they are. Every
+    call invalidates Iterators and Cursors, and with InlineValues also
+    value pointers; SlabValues values are never moved.*/
+    bool compact(size_t max_nodes = 0)
+    {
+        return Curr_Map.compact_step(max_nodes);
+    }
+    /*Opt in to a Bloom filter over the keys, checked before find, at,
+    count, erase, extract and try_get descend. Keys it has never seen are
+    rejected in O(1) without touching the tree; about 1% of misses still
+    descend. Costs 8 to 32 bits per key and an O(1) amortized update on
+    insert and erase. Only lookups by Key_T itself are filtered.*/
+    void set_membership_filter(bool enabled)
+    {
+        static_assert(IsHashable<Key_T>::value, "the membership filter needs std::hash<Key_T>");
+        Curr_Map.set_filter(enabled);
+    }
+    /*Report tree shape (height, black height, depth distribution, red
+    nodes) and bytes used split into node, key, value and allocator slack.
+    Key and value bytes count sizeof only, not memory the types own. The
+    membership filter, when on, counts towards slack and total. Slack and
+    total assume glibc malloc's chunk sizes; see Stats.*/
+    Stats stats() const
+    {
+        Stats out;
+        Curr_Map.collect_stats(out);
+        return out;
+    }
     Iterator begin()
     {
         Iterator it = Iterator(first, this);
@@ -940,6 +3204,124 @@ public:
         RBNode *temp = Curr_Map.find_node(key);
         return ConstIterator(temp, this);
     }
+    /*Heterogeneous overloads: look up by any type comparable with Key_T,
+    e.g. a const char * in a Map keyed by std::string, without building a
+    temporary Key_T*/
+    template<typename K, typename = Comparable<K>>
+    Iterator find(const K &key)
+    {
+        RBNode *temp = Curr_Map.find_node(key);
+        return Iterator(temp, this);
+    }
+    template<typename K, typename = Comparable<K>>
+    ConstIterator find(const K &key) const
+    {
+        RBNode *temp = Curr_Map.find_node(key);
+        return ConstIterator(temp, this);
+    }
+    size_t count(const Key_T &key) const
+    {
+        return count<Key_T>(key);
+    }
+    template<typename K, typename = Comparable<K>>
+    size_t count(const K &key) const
+    {
+        return Curr_Map.find_node(key) == nullptr ? 0 : 1;
+    }
+    Iterator lower_bound(const Key_T &key)
+    {
+        return lower_bound<Key_T>(key);
+    }
+    ConstIterator lower_bound(const Key_T &key) const
+    {
+        return lower_bound<Key_T>(key);
+    }
+    template<typename K, typename = Comparable<K>>
+    Iterator lower_bound(const K &key)
+    {
+        return Iterator(Curr_Map.lower_bound_node(key), this);
+    }
+    template<typename K, typename = Comparable<K>>
+    ConstIterator lower_bound(const K &key) const
+    {
+        return ConstIterator(Curr_Map.lower_bound_node(key), this);
+    }
+    Iterator upper_bound(const Key_T &key)
+    {
+        return upper_bound<Key_T>(key);
+    }
+    ConstIterator upper_bound(const Key_T &key) const
+    {
+        return upper_bound<Key_T>(key);
+    }
+    template<typename K, typename = Comparable<K>>
+    Iterator upper_bound(const K &key)
+    {
+        return Iterator(Curr_Map.upper_bound_node(key), this);
+    }
+    template<typename K, typename = Comparable<K>>
+    ConstIterator upper_bound(const K &key) const
+    {
+        return ConstIterator(Curr_Map.upper_bound_node(key), this);
+    }
+    /*Look up every key in keys, setting out[i] to the value stored for
+    keys[i] or nullptr if it is absent. Faster than repeated find() since
+    descents are interleaved, or share their path when keys are sorted.*/
+    void find_batch(const std::vector<Key_T> &keys, std::vector<Mapped_T *> &out)
+    {
+        std::vector<RBNode *> nodes(keys.size());
+        Curr_Map.find_nodes(keys.data(), keys.size(), nodes.data());
+        out.resize(keys.size());
+        for(size_t i = 0; i < keys.size(); i++)
+        {
+            out[i] = nodes[i] == nullptr ? nullptr : nodes[i]->value.get();
+        }
+    }
+    void find_batch(const std::vector<Key_T> &keys, std::vector<const Mapped_T *> &out) const
+    {
+        std::vector<RBNode *> nodes(keys.size());
+        Curr_Map.find_nodes(keys.data(), keys.size(), nodes.data());
+        out.resize(keys.size());
+        for(size_t i = 0; i < keys.size(); i++)
+        {
+            out[i] = nodes[i] == nullptr ? nullptr : nodes[i]->value.get();
+        }
+    }
+    /*Set out[i] to whether keys[i] is in the Map*/
+    void contains_batch(const std::vector<Key_T> &keys, std::vector<bool> &out) const
+    {
+        std::vector<RBNode *> nodes(keys.size());
+        Curr_Map.find_nodes(keys.data(), keys.size(), nodes.data());
+        out.resize(keys.size());
+        for(size_t i = 0; i < keys.size(); i++)
+        {
+            out[i] = nodes[i] != nullptr;
+        }
+    }
+    /*Pointer to the value for key, or nullptr if key is absent. Unlike
+    at, a miss costs only the lookup, never an exception.*/
+    Mapped_T *try_get(const Key_T &key)
+    {
+        RBNode *found = Curr_Map.find_node(key);
+        return found == nullptr ? nullptr : found->value.get();
+    }
+    const Mapped_T *try_get(const Key_T &key) const
+    {
+        RBNode *found = Curr_Map.find_node(key);
+        return found == nullptr ? nullptr : found->value.get();
+    }
+    template<typename K, typename = Comparable<K>>
+    Mapped_T *try_get(const K &key)
+    {
+        RBNode *found = Curr_Map.find_node(key);
+        return found == nullptr ? nullptr : found->value.get();
+    }
+    template<typename K, typename = Comparable<K>>
+    const Mapped_T *try_get(const K &key) const
+    {
+        RBNode *found = Curr_Map.find_node(key);
+        return found == nullptr ? nullptr : found->value.get();
+    }
     Mapped_T &at(const Key_T &key)
     {
         return Curr_Map.find_val(key);
@@ -948,18 +3330,47 @@ public:
     {
         return Curr_Map.find_val(key);
     }
+    template<typename K, typename = Comparable<K>>
+    Mapped_T &at(const K &key)
+    {
+        return Curr_Map.find_val(key);
+    }
+    template<typename K, typename = Comparable<K>>
+    const Mapped_T &at(const K &key) const
+    {
+        return Curr_Map.find_val(key);
+    }
+    /*Return the value stored for key, inserting a default-constructed
+    one first if key is absent. Takes a single descent.*/
     Mapped_T &operator[](const Key_T &key)
     {
-        RBNode *temp = Curr_Map.find_node(key);
-        if(temp != nullptr)
-        {
-            return *temp->value;
-        }
-        else
+        return *Curr_Map.emplace_node(key).first->value;
+    }
+    /*Insert key with a Mapped_T built from args unless key is present,
+    in which case args are left untouched. Returns a pointer to the stored
+    value, stable until the entry is erased, and whether it was inserted.*/
+    template<typename... Args>
+    std::pair<Mapped_T *, bool> try_emplace(const Key_T &key, Args&&... args)
+    {
+        std::pair<RBNode *, bool> ret = Curr_Map.emplace_node(key, std::forward<Args>(args)...);
+        return {ret.first->value.get(), ret.second};
+    }
+    /*Insert key with obj, or assign obj over the existing value, in a
+    single descent. Returns like try_emplace.*/
+    template<typename M>
+    std::pair<Mapped_T *, bool> insert_or_assign(const Key_T &key, M &&obj)
+    {
+        RBNode *curr_parent;
+        bool left;
+        RBNode *found = Curr_Map.find_slot(key, curr_parent, left);
+        if(found != nullptr)
         {
-            mapped = Mapped_T();
-            return mapped;
+            *found->value = std::forward<M>(obj);
+            return {found->value.get(), false};
         }
+        RBNode *new_node = Curr_Map.create_node(key, std::forward<M>(obj));
+        Curr_Map.link_node(new_node, curr_parent, left);
+        return {new_node->value.get(), true};
     }
     std::pair<Iterator, bool> insert(const ValueType &value)
     {
@@ -975,6 +3386,22 @@ public:
             return {it, ret.second};
         }
     }
+    /*Link the node owned by handle into this Map. On success the handle
+    is left empty; if the key is already present it keeps the node and the
+    returned Iterator points at the existing entry.*/
+    std::pair<Iterator, bool> insert(NodeHandle &&handle)
+    {
+        if(handle.empty())
+        {
+            return {end(), false};
+        }
+        std::pair<RBNode *, bool> ret = Curr_Map.insert_existing(handle.node);
+        if(ret.second)
+        {
+            handle.node = nullptr;
+        }
+        return {Iterator(ret.first, this), ret.second};
+    }
     template <typename IT_T>
     void insert(IT_T range_beg, IT_T range_end)
     {
@@ -984,18 +3411,195 @@ public:
             Curr_Map.insert_node((*it).first, (*it).second);
         }
     }
-    void erase(Iterator pos)
+    /*Remove the entry pos points at, starting from its node rather than
+    searching again, and return an Iterator to the entry after it*/
+    Iterator erase(Iterator pos)
+    {
+        RBNode *next = pos.target->next;
+        Curr_Map.erase_nodes(pos.target, next);
+        return Iterator(next, this);
+    }
+    /*Remove the entries from range_beg up to but not including range_end*/
+    Iterator erase(Iterator range_beg, Iterator range_end)
+    {
+        Curr_Map.erase_nodes(range_beg.target, range_end.target);
+        return Iterator(range_end.target, this);
+    }
+    /*Remove every entry with lo <= key < hi and return how many were
+    removed. Costs two descents plus O(k) amortized for k removed entries,
+    or an O(n) rebuild once k log n >= n.*/
+    size_t erase_range(const Key_T &lo, const Key_T &hi)
+    {
+        return erase_range<Key_T>(lo, hi);
+    }
+    template<typename K, typename = Comparable<K>>
+    size_t erase_range(const K &lo, const K &hi)
     {
-        Curr_Map.delete_node((*pos).first);
+        RBNode *range_beg = Curr_Map.lower_bound_node(lo);
+        RBNode *range_end = Curr_Map.lower_bound_node(hi);
+
+        //hi <= lo leaves range_end ahead of range_beg; compare through
+        //Key_T so K need not order against itself (e.g. string literals)
+        if(range_end != nullptr && *range_end->key < lo)
+        {
+            return 0;
+        }
+        return Curr_Map.erase_nodes(range_beg, range_end);
     }
     void erase(const Key_T &key)
     {
         Curr_Map.delete_node(key);
     }
+    template<typename K, typename = Comparable<K>>
+    void erase(const K &key)
+    {
+        Curr_Map.delete_node(key);
+    }
+    /*Unlink the entry for key and hand its node to the caller. The
+    handle is empty if key is absent.*/
+    NodeHandle extract(const Key_T &key)
+    {
+        return NodeHandle(Curr_Map.extract_node(Curr_Map.find_node(key)));
+    }
+    template<typename K, typename = Comparable<K>>
+    NodeHandle extract(const K &key)
+    {
+        return NodeHandle(Curr_Map.extract_node(Curr_Map.find_node(key)));
+    }
+    NodeHandle extract(Iterator pos)
+    {
+        return NodeHandle(Curr_Map.extract_node(pos.target));
+    }
+    /*The entry with the smallest key, read straight from first. Throws
+    std::out_of_range if the Map is empty.*/
+    std::pair<const Key_T &, Mapped_T &> front()
+    {
+        if(first == nullptr)
+        {
+            throw std::out_of_range("Map is empty");
+        }
+        return {*first->key, *first->value};
+    }
+    std::pair<const Key_T &, const Mapped_T &> front() const
+    {
+        if(first == nullptr)
+        {
+            throw std::out_of_range("Map is empty");
+        }
+        return {*first->key, *first->value};
+    }
+    /*The entry with the largest key, as front*/
+    std::pair<const Key_T &, Mapped_T &> back()
+    {
+        if(last == nullptr)
+        {
+            throw std::out_of_range("Map is empty");
+        }
+        return {*last->key, *last->value};
+    }
+    std::pair<const Key_T &, const Mapped_T &> back() const
+    {
+        if(last == nullptr)
+        {
+            throw std::out_of_range("Map is empty");
+        }
+        return {*last->key, *last->value};
+    }
+    /*Unlink the smallest entry and hand its node to the caller, starting
+    from first instead of descending from the root. That node never has a
+    left child, so removal is an amortized O(1) splice and fix-up. The
+    handle is empty if the Map is.*/
+    NodeHandle pop_front()
+    {
+        return NodeHandle(Curr_Map.extract_node(first));
+    }
+    /*Unlink the largest entry, as pop_front*/
+    NodeHandle pop_back()
+    {
+        return NodeHandle(Curr_Map.extract_node(last));
+    }
+    /*Call fn(key, value) on the count smallest entries (or all, if fewer)
+    in key order, then remove them and return how many were removed. Large
+    batches are cut from the list whole and the tree rebuilt once.*/
+    template<typename Fn>
+    size_t pop_front_n(size_t count, Fn fn)
+    {
+        RBNode *range_end = first;
+        for(size_t i = 0; i < count && range_end != nullptr; i++)
+        {
+            fn(static_cast<const Key_T &>(*range_end->key), *range_end->value);
+            range_end = range_end->next;
+        }
+        return Curr_Map.erase_nodes(first, range_end);
+    }
+    size_t pop_front_n(size_t count)
+    {
+        return pop_front_n(count, [](const Key_T &, Mapped_T &) {});
+    }
+    /*Move every entry of source whose key is not already here into this
+    Map by relinking its nodes. Entries with clashing keys stay in source.*/
+    void merge(Map &source)
+    {
+        if(&source != this)
+        {
+            Curr_Map.merge_from(source.Curr_Map);
+        }
+    }
+    /*Replace the contents with the (key, value) pairs in a range sorted by
+    strictly ascending key, in O(n) rather than O(n log n). Throws
+    std::invalid_argument, leaving the Map empty, if the range is not
+    strictly ascending.*/
+    template<typename IT_T>
+    void assign_sorted(IT_T range_beg, IT_T range_end)
+    {
+        Curr_Map.assign_sorted(range_beg, range_end);
+    }
+    /*Move every entry with key >= split_key into upper, which must be an
+    empty Map, without copying or reallocating. Costs O(n).*/
+    void split(const Key_T &split_key, Map &upper)
+    {
+        split<Key_T>(split_key, upper);
+    }
+    template<typename K, typename = Comparable<K>>
+    void split(const K &split_key, Map &upper)
+    {
+        if(&upper == this || !upper.empty())
+        {
+            throw std::invalid_argument("split target must be an empty Map");
+        }
+        Curr_Map.split_to(Curr_Map.lower_bound_node(split_key), upper.Curr_Map);
+    }
     void clear()
     {
         Curr_Map.delete_map();
     }
+    /*Apply every op in batch, leaving batch empty. Ops are sorted and
+    deduplicated first, then merged into the tree in a single pass.*/
+    void apply(WriteBatch &batch)
+    {
+        std::vector<BatchOp> &ops = batch.ops;
+        std::stable_sort(ops.begin(), ops.end(),
+            [](const BatchOp &a, const BatchOp &b) { return a.key < b.key; });
+
+        //keep only the last op for each key
+        size_t kept = 0;
+        for(size_t i = 0; i < ops.size(); i++)
+        {
+            if(i + 1 < ops.size() && !(ops[i].key < ops[i + 1].key))
+            {
+                continue;
+            }
+            if(kept != i)
+            {
+                ops[kept] = std::move(ops[i]);
+            }
+            kept++;
+        }
+        ops.erase(ops.begin() + kept, ops.end());
+
+        Curr_Map.apply_sorted(ops);
+        batch.clear();
+    }
     bool operator==(const Map &Map2)
     {
         auto iter = this->begin();
@@ -1075,6 +3679,6 @@ public:
     }
 };
 
-#endif // MAP_HPP
-
 }
+
+#endif // MAP_HPP
@@ -0,0 +1,370 @@
+#ifndef SHARDEDMAP_HPP_INCLUDED
+#define SHARDEDMAP_HPP_INCLUDED
+
+#include "Map.hpp"
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+
+namespace kanec1994
+{
+
+/*A Map split into range shards, each its own Map behind its own lock, so
+writers to different key ranges do not contend. Point operations lock
+only the shard that owns the key, plus one of several routing locks
+picked by thread, so threads share no counter or lock word. Shards cover
+consecutive key ranges, so visiting them in order gives key order without
+a merge step. Hot shards are split and cold neighbours merged once any
+shard takes rebalance_interval writes, or whenever rebalance() is
+called.*/
+template<typename Key_T, typename Mapped_T>
+class ShardedMap
+{
+private:
+    typedef Map<Key_T, Mapped_T> Shard_Map;
+    //ops and writes are only touched under the shard lock, and read by
+    //rebalance while it holds every routing lock
+    struct Shard
+    {
+        Shard_Map map;
+        mutable std::mutex lock;
+        size_t ops;
+        size_t writes;
+        Shard()
+        {
+            ops = 0;
+            writes = 0;
+        }
+    };
+    //one routing lock per stripe, padded so no two share a cache line
+    struct RouteStripe
+    {
+        std::shared_timed_mutex lock;
+        char pad[64];
+    };
+    /*Holds every routing lock, in order, so the shard layout can change*/
+    class ExclusiveRoute
+    {
+    private:
+        std::vector<RouteStripe> &stripes;
+    public:
+        ExclusiveRoute(std::vector<RouteStripe> &all) : stripes(all)
+        {
+            for(RouteStripe &stripe : stripes)
+            {
+                stripe.lock.lock();
+            }
+        }
+        ~ExclusiveRoute()
+        {
+            for(size_t i = stripes.size(); i > 0; i--)
+            {
+                stripes[i - 1].lock.unlock();
+            }
+        }
+    };
+    //shards[i] holds keys in [bounds[i - 1], bounds[i]); the ends are unbounded
+    std::vector<std::unique_ptr<Shard>> shards;
+    std::vector<Key_T> bounds;
+    mutable std::vector<RouteStripe> route_stripes;
+    size_t max_shards;
+    size_t rebalance_interval;
+    static const size_t chunk = 256;
+
+    size_t shard_index(const Key_T &key) const
+    {
+        return std::upper_bound(bounds.begin(), bounds.end(), key) - bounds.begin();
+    }
+    /*Share the calling thread's routing lock, which keeps the shard layout
+    fixed while held. Each thread hashes to one stripe once.*/
+    std::shared_lock<std::shared_timed_mutex> route() const
+    {
+        static thread_local size_t thread_hash = std::hash<std::thread::id>()(std::this_thread::get_id());
+        return std::shared_lock<std::shared_timed_mutex>(route_stripes[thread_hash % route_stripes.size()].lock);
+    }
+    /*Run fn on the Map owning key while holding its lock. A write sets
+    *rebalance_due once its shard reaches rebalance_interval writes; the
+    caller then rebalances with no lock held.*/
+    template<typename Fn>
+    auto with_shard(const Key_T &key, bool *rebalance_due, Fn fn) const -> decltype(fn(std::declval<Shard_Map &>()))
+    {
+        std::shared_lock<std::shared_timed_mutex> routed = route();
+        Shard &shard = *shards[shard_index(key)];
+        std::lock_guard<std::mutex> guard(shard.lock);
+        shard.ops++;
+        if(rebalance_due != nullptr && ++shard.writes == rebalance_interval)
+        {
+            *rebalance_due = true;
+        }
+        return fn(shard.map);
+    }
+    /*Visit shards from the one owning lo (or the first, if lo is nullptr)
+    up to the one owning hi (or the last), copying each one's entries in
+    [lo, hi) out under its lock and handing them to fn with no lock held.
+    Between shards the layout may change, so each round routes by the
+    upper bound of the shard before it rather than by shard index.*/
+    template<typename Fn>
+    void gather(const Key_T *lo, const Key_T *hi, Fn &fn) const
+    {
+        std::vector<Key_T> key_buf(chunk);
+        std::vector<Mapped_T> value_buf(chunk);
+        std::vector<std::pair<Key_T, Mapped_T>> gathered;
+        //every key below *from has already been visited
+        std::unique_ptr<Key_T> from;
+        while(true)
+        {
+            bool last;
+            gathered.clear();
+            {
+                std::shared_lock<std::shared_timed_mutex> routed = route();
+                const Key_T *start = from != nullptr ? from.get() : lo;
+                size_t index = start == nullptr ? 0 : shard_index(*start);
+                const Shard &shard = *shards[index];
+                std::lock_guard<std::mutex> guard(shard.lock);
+                auto collect = [&](const Key_T *keys, const Mapped_T *values, size_t count)
+                {
+                    for(size_t i = 0; i < count; i++)
+                    {
+                        if(start == nullptr || !(keys[i] < *start))
+                        {
+                            gathered.push_back({keys[i], values[i]});
+                        }
+                    }
+                };
+                if(hi != nullptr)
+                {
+                    shard.map.scan_chunks(*start, *hi, key_buf.data(), value_buf.data(), chunk, collect);
+                }
+                else
+                {
+                    shard.map.scan_chunks(key_buf.data(), value_buf.data(), chunk, collect);
+                }
+                last = index >= bounds.size() || (hi != nullptr && !(bounds[index] < *hi));
+                if(!last)
+                {
+                    from.reset(new Key_T(bounds[index]));
+                }
+            }
+            for(const std::pair<Key_T, Mapped_T> &entry : gathered)
+            {
+                fn(entry.first, entry.second);
+            }
+            if(last)
+            {
+                return;
+            }
+        }
+    }
+    /*Key of the middle entry of map*/
+    static Key_T median_key(const Shard_Map &map)
+    {
+        size_t target = map.size() / 2;
+        size_t index = 0;
+        Key_T median = Key_T();
+        std::vector<Key_T> key_buf(chunk);
+        map.scan_chunks(key_buf.data(), nullptr, chunk, [&](const Key_T *keys, const Mapped_T *, size_t count)
+        {
+            if(index <= target && target < index + count)
+            {
+                median = keys[target - index];
+            }
+            index += count;
+        });
+        return median;
+    }
+public:
+    /*Start with one shard per range between sorted, distinct split_keys.
+    max_shard_count caps adaptive splitting (0 means four per hardware
+    thread) and rebalance_every sets how many writes one shard takes
+    before an automatic rebalance (0 turns them off).*/
+    ShardedMap(const std::vector<Key_T> &split_keys = std::vector<Key_T>(), size_t max_shard_count = 0,
+        size_t rebalance_every = 65536)
+    {
+        bounds = split_keys;
+        for(size_t i = 0; i <= bounds.size(); i++)
+        {
+            shards.emplace_back(new Shard());
+        }
+        unsigned threads = std::thread::hardware_concurrency();
+        if(threads == 0)
+        {
+            threads = 1;
+        }
+        max_shards = max_shard_count == 0 ? 4 * static_cast<size_t>(threads) : max_shard_count;
+        rebalance_interval = rebalance_every;
+        route_stripes = std::vector<RouteStripe>(threads);
+    }
+    ShardedMap(const ShardedMap &) = delete;
+    ShardedMap &operator=(const ShardedMap &) = delete;
+
+    /*Insert key with value unless key is present*/
+    bool insert(const Key_T &key, const Mapped_T &value)
+    {
+        bool rebalance_due = false;
+        bool inserted = with_shard(key, &rebalance_due, [&](Shard_Map &map)
+        {
+            return map.try_emplace(key, value).second;
+        });
+        if(rebalance_due)
+        {
+            rebalance();
+        }
+        return inserted;
+    }
+    void insert_or_assign(const Key_T &key, const Mapped_T &value)
+    {
+        bool rebalance_due = false;
+        with_shard(key, &rebalance_due, [&](Shard_Map &map)
+        {
+            map.insert_or_assign(key, value);
+        });
+        if(rebalance_due)
+        {
+            rebalance();
+        }
+    }
+    /*Call fn on the value for key, default-constructing it first if key is
+    absent, all under the shard lock. Use for read-modify-write such as
+    counters, since references into a shard cannot outlive its lock.*/
+    template<typename Fn>
+    void update(const Key_T &key, Fn fn)
+    {
+        bool rebalance_due = false;
+        with_shard(key, &rebalance_due, [&](Shard_Map &map)
+        {
+            fn(map[key]);
+        });
+        if(rebalance_due)
+        {
+            rebalance();
+        }
+    }
+    bool erase(const Key_T &key)
+    {
+        bool rebalance_due = false;
+        bool erased = with_shard(key, &rebalance_due, [&](Shard_Map &map)
+        {
+            size_t before = map.size();
+            map.erase(key);
+            return map.size() != before;
+        });
+        if(rebalance_due)
+        {
+            rebalance();
+        }
+        return erased;
+    }
+    /*Copy the value for key into out and return true, or return false*/
+    bool get(const Key_T &key, Mapped_T &out) const
+    {
+        return with_shard(key, nullptr, [&](Shard_Map &map)
+        {
+            const Mapped_T *value = map.try_get(key);
+            if(value == nullptr)
+            {
+                return false;
+            }
+            out = *value;
+            return true;
+        });
+    }
+    bool contains(const Key_T &key) const
+    {
+        return with_shard(key, nullptr, [&](Shard_Map &map)
+        {
+            return map.count(key) != 0;
+        });
+    }
+    size_t size() const
+    {
+        std::shared_lock<std::shared_timed_mutex> routed = route();
+        size_t total = 0;
+        for(const std::unique_ptr<Shard> &shard : shards)
+        {
+            std::lock_guard<std::mutex> guard(shard->lock);
+            total += shard->map.size();
+        }
+        return total;
+    }
+    size_t shard_count() const
+    {
+        std::shared_lock<std::shared_timed_mutex> routed = route();
+        return shards.size();
+    }
+    /*Call fn(key, value) for entries with lo <= key < hi in key order.
+    Each shard is copied out under its own lock and fn runs with no lock
+    held, so fn may use this ShardedMap. The view is consistent within a
+    shard but not across shards.*/
+    template<typename Fn>
+    void for_each_range(const Key_T &lo, const Key_T &hi, Fn fn) const
+    {
+        if(lo < hi)
+        {
+            gather(&lo, &hi, fn);
+        }
+    }
+    /*Call fn(key, value) for every entry in key order, as for_each_range*/
+    template<typename Fn>
+    void for_each(Fn fn) const
+    {
+        gather(nullptr, nullptr, fn);
+    }
+    /*Compare each shard's operations since the last rebalance with a
+    fair share, the total spread over max_shards. Shards above twice that
+    are split at their median key, then neighbouring shards that together
+    took under half of it are merged. Blocks all other operations while
+    it runs, and restarts every shard's write count.*/
+    void rebalance()
+    {
+        ExclusiveRoute exclusive(route_stripes);
+        size_t total_ops = 0;
+        for(const std::unique_ptr<Shard> &shard : shards)
+        {
+            total_ops += shard->ops;
+        }
+        size_t fair = total_ops / max_shards;
+        if(fair == 0)
+        {
+            return;
+        }
+
+        for(size_t i = 0; i < shards.size() && shards.size() < max_shards; i++)
+        {
+            Shard &shard = *shards[i];
+            if(shard.ops > 2 * fair && shard.map.size() >= 2)
+            {
+                Key_T median = median_key(shard.map);
+                std::unique_ptr<Shard> upper(new Shard());
+                shard.map.split(median, upper->map);
+                upper->ops = shard.ops / 2;
+                shard.ops -= upper->ops;
+                shards.insert(shards.begin() + i + 1, std::move(upper));
+                bounds.insert(bounds.begin() + i, median);
+                i++;
+            }
+        }
+        for(size_t i = 0; i + 1 < shards.size();)
+        {
+            if(shards[i]->ops + shards[i + 1]->ops < fair / 2)
+            {
+                shards[i]->map.merge(shards[i + 1]->map);
+                shards[i]->ops += shards[i + 1]->ops;
+                shards.erase(shards.begin() + i + 1);
+                bounds.erase(bounds.begin() + i);
+            }
+            else
+            {
+                i++;
+            }
+        }
+        for(const std::unique_ptr<Shard> &shard : shards)
+        {
+            shard->ops = 0;
+            shard->writes = 0;
+        }
+    }
+};
+
+}
+
+#endif // SHARDEDMAP_HPP_INCLUDED
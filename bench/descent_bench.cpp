@@ -0,0 +1,75 @@
+#include "Map.hpp"
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+using namespace kanec1994;
+
+/*A uint64_t behind a class, so Map stores it through the generic key
+slot and looks it up with the generic three-way descent*/
+struct BoxedKey
+{
+    uint64_t value;
+    bool operator<(const BoxedKey &other) const
+    {
+        return value < other.value;
+    }
+};
+
+/*Time count() over probes and return nanoseconds per lookup. sink keeps
+the lookups from being optimised away.*/
+template<typename Map_T, typename Key_T>
+double time_lookups(const Map_T &map, const std::vector<Key_T> &probes, size_t &sink)
+{
+    auto start = std::chrono::steady_clock::now();
+    for(const Key_T &key : probes)
+    {
+        sink += map.count(key);
+    }
+    std::chrono::duration<double, std::nano> elapsed = std::chrono::steady_clock::now() - start;
+    return elapsed.count() / probes.size();
+}
+
+/*Build both Maps from the same random keys and time the same probes,
+half hits and half misses, against each*/
+void run(size_t entries, size_t lookups)
+{
+    std::mt19937_64 rng(entries);
+    std::vector<uint64_t> keys(entries);
+    Map<uint64_t, uint64_t> inline_map;
+    Map<BoxedKey, uint64_t> generic_map;
+    for(size_t i = 0; i < entries; i++)
+    {
+        keys[i] = rng() | 1;
+        inline_map.insert({keys[i], i});
+        generic_map.insert({BoxedKey{keys[i]}, i});
+    }
+
+    std::vector<uint64_t> probes(lookups);
+    std::vector<BoxedKey> boxed_probes(lookups);
+    for(size_t i = 0; i < lookups; i++)
+    {
+        //odd keys were inserted, so clearing the low bit gives a miss
+        probes[i] = i % 2 == 0 ? keys[rng() % entries] : (rng() & ~static_cast<uint64_t>(1));
+        boxed_probes[i] = BoxedKey{probes[i]};
+    }
+
+    size_t sink = 0;
+    double generic_ns = time_lookups(generic_map, boxed_probes, sink);
+    double inline_ns = time_lookups(inline_map, probes, sink);
+    std::cout << entries << " entries: generic " << generic_ns << " ns, inline branchless "
+        << inline_ns << " ns per lookup (" << sink / 2 << " hits each)" << std::endl;
+}
+
+int main(int argc, char **argv)
+{
+    size_t lookups = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 2000000;
+    for(size_t entries : {1000, 100000, 1000000})
+    {
+        run(entries, lookups);
+    }
+    return 0;
+}
@@ -0,0 +1,232 @@
+#include "DurableMap.hpp"
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace kanec1994;
+
+/*Reopen, torn-tail, checkpoint and failed-write checks for DurableMap,
+each on fresh files in a temporary directory. Exits non-zero at the first
+mismatch.*/
+
+typedef DurableMap<uint64_t, std::string> Durable;
+
+static size_t failures = 0;
+
+static void expect(bool ok, const std::string &what)
+{
+    if(!ok)
+    {
+        std::cerr << what << std::endl;
+        failures++;
+    }
+}
+
+static size_t file_size(const std::string &path)
+{
+    struct stat info;
+    return ::stat(path.c_str(), &info) == 0 ? static_cast<size_t>(info.st_size) : 0;
+}
+
+static bool file_exists(const std::string &path)
+{
+    struct stat info;
+    return ::stat(path.c_str(), &info) == 0;
+}
+
+static void remove_files(const std::string &path)
+{
+    ::unlink((path + ".log").c_str());
+    ::unlink((path + ".ckpt").c_str());
+    ::unlink((path + ".ckpt.tmp").c_str());
+}
+
+static bool same(const Durable &durable, const std::map<uint64_t, std::string> &ref)
+{
+    if(durable.map().size() != ref.size())
+    {
+        return false;
+    }
+    for(const std::pair<const uint64_t, std::string> &entry : ref)
+    {
+        const std::string *value = durable.map().try_get(entry.first);
+        if(value == nullptr || *value != entry.second)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static std::string value_of(uint64_t key)
+{
+    return std::string(key % 23, static_cast<char>('a' + key % 26));
+}
+
+/*Writes and erases survive closing and reopening, in every sync mode*/
+static void reopen(const std::string &path)
+{
+    for(SyncMode mode : {SyncMode::none, SyncMode::group, SyncMode::always})
+    {
+        remove_files(path);
+        std::map<uint64_t, std::string> ref;
+        {
+            Durable durable(path, mode, 1024);
+            for(uint64_t key = 0; key < 2000; key++)
+            {
+                durable.insert_or_assign(key * 7 % 1009, value_of(key));
+                ref[key * 7 % 1009] = value_of(key);
+                if(key % 3 == 0)
+                {
+                    durable.erase(key % 500);
+                    ref.erase(key % 500);
+                }
+            }
+        }
+        Durable durable(path, mode);
+        expect(same(durable, ref), "reopen lost or changed entries");
+    }
+}
+
+/*A partly written last record is dropped and cut off the log on reopen,
+and records written after that are replayed normally*/
+static void torn_tail(const std::string &path)
+{
+    remove_files(path);
+    std::map<uint64_t, std::string> ref;
+    size_t good_size;
+    {
+        Durable durable(path);
+        for(uint64_t key = 0; key < 100; key++)
+        {
+            durable.insert_or_assign(key, value_of(key));
+            ref[key] = value_of(key);
+        }
+        durable.commit();
+        good_size = file_size(path + ".log");
+        durable.insert_or_assign(1000, "torn");
+    }
+    size_t full_size = file_size(path + ".log");
+    expect(full_size > good_size, "last record was not written");
+    expect(::truncate((path + ".log").c_str(), static_cast<off_t>(full_size - 3)) == 0, "cannot truncate log");
+    {
+        Durable durable(path);
+        expect(same(durable, ref), "torn record was replayed or earlier ones lost");
+        expect(file_size(path + ".log") == good_size, "torn tail was not cut off");
+        durable.insert_or_assign(2000, "after");
+        ref[2000] = "after";
+    }
+    Durable durable(path);
+    expect(same(durable, ref), "record written after a torn tail was lost");
+}
+
+/*Crossing checkpoint_bytes writes a checkpoint and empties the log;
+reopening loads it and replays the writes made since*/
+static void checkpoint_then_replay(const std::string &path)
+{
+    remove_files(path);
+    std::map<uint64_t, std::string> ref;
+    {
+        Durable durable(path, SyncMode::group, 512, 4096);
+        for(uint64_t key = 0; key < 3000; key++)
+        {
+            durable.insert_or_assign(key % 800, value_of(key));
+            ref[key % 800] = value_of(key);
+            if(key % 4 == 0)
+            {
+                durable.erase(key % 300);
+                ref.erase(key % 300);
+            }
+        }
+        expect(file_exists(path + ".ckpt"), "no checkpoint written");
+        expect(file_size(path + ".log") < 4096 + 512, "log not reset by checkpoint");
+        durable.checkpoint();
+        expect(file_size(path + ".log") == 0, "explicit checkpoint left the log");
+        durable.insert_or_assign(5000, "tail");
+        durable.erase(10);
+        ref[5000] = "tail";
+        ref.erase(10);
+    }
+    expect(!file_exists(path + ".ckpt.tmp"), "temporary checkpoint left behind");
+    Durable durable(path);
+    expect(same(durable, ref), "checkpoint plus log replay differs");
+}
+
+/*A write the log cannot take leaves both the Map and the log as they
+were. The file size limit makes the write fail with EFBIG.*/
+static void failed_write(const std::string &path)
+{
+    remove_files(path);
+    std::map<uint64_t, std::string> ref;
+    struct rlimit old_limit;
+    ::getrlimit(RLIMIT_FSIZE, &old_limit);
+    std::signal(SIGXFSZ, SIG_IGN);
+    {
+        Durable durable(path, SyncMode::always);
+        for(uint64_t key = 0; key < 10; key++)
+        {
+            durable.insert_or_assign(key, value_of(key));
+            ref[key] = value_of(key);
+        }
+        size_t good_size = file_size(path + ".log");
+
+        struct rlimit limit = old_limit;
+        limit.rlim_cur = good_size + 4;
+        ::setrlimit(RLIMIT_FSIZE, &limit);
+        bool put_thrown = false;
+        bool erase_thrown = false;
+        try
+        {
+            durable.insert_or_assign(100, std::string(64, 'x'));
+        }
+        catch(const std::runtime_error &)
+        {
+            put_thrown = true;
+        }
+        try
+        {
+            durable.erase(3);
+        }
+        catch(const std::runtime_error &)
+        {
+            erase_thrown = true;
+        }
+        ::setrlimit(RLIMIT_FSIZE, &old_limit);
+
+        expect(put_thrown && erase_thrown, "write past the size limit did not throw");
+        expect(same(durable, ref), "failed write changed the Map");
+        expect(file_size(path + ".log") == good_size, "failed write left part of a record");
+        durable.insert_or_assign(200, "later");
+        ref[200] = "later";
+    }
+    Durable durable(path);
+    expect(same(durable, ref), "reopen after a failed write differs");
+}
+
+int main()
+{
+    char dir_template[] = "/tmp/durable_map_XXXXXX";
+    char *dir = ::mkdtemp(dir_template);
+    if(dir == nullptr)
+    {
+        std::cerr << "cannot create a temporary directory" << std::endl;
+        return EXIT_FAILURE;
+    }
+    std::string path = std::string(dir) + "/map";
+
+    reopen(path);
+    torn_tail(path);
+    checkpoint_then_replay(path);
+    failed_write(path);
+
+    remove_files(path);
+    ::rmdir(dir);
+    std::cout << "durable map: " << (failures == 0 ? "ok" : "FAILED") << std::endl;
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,592 @@
+#include "Map.hpp"
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+using namespace kanec1994;
+
+/*Randomized operations on a Map checked against std::map after every
+round: same entries in both directions, size, front and back, equal black
+height on every root-to-leaf path, and a height within the Red-Black
+bound of 2 log2(n + 1), plus the lookup, batch, scan and parallel
+interfaces. Exits non-zero at the first mismatch.*/
+
+static size_t failures = 0;
+
+static void expect(bool ok, const std::string &what, size_t round)
+{
+    if(!ok)
+    {
+        std::cerr << "round " << round << ": " << what << std::endl;
+        failures++;
+    }
+}
+
+template<typename Map_T, typename Ref_T>
+void check(Map_T &map, const Ref_T &ref, size_t round)
+{
+    expect(map.size() == ref.size(), "size", round);
+    typename Ref_T::const_iterator expected = ref.begin();
+    for(auto it = map.begin(); it != map.end(); ++it, ++expected)
+    {
+        if(expected == ref.end() || !((*it).first == expected->first) || !((*it).second == expected->second))
+        {
+            expect(false, "in-order walk", round);
+            return;
+        }
+    }
+    expect(expected == ref.end(), "in-order walk ends early", round);
+
+    typename Ref_T::const_reverse_iterator back_expected = ref.rbegin();
+    for(auto it = map.rbegin(); it != map.rend(); ++it, ++back_expected)
+    {
+        if(back_expected == ref.rend() || !((*it).first == back_expected->first))
+        {
+            expect(false, "reverse walk", round);
+            return;
+        }
+    }
+    if(!ref.empty())
+    {
+        expect(map.front().first == ref.begin()->first, "front", round);
+        expect(map.back().first == ref.rbegin()->first, "back", round);
+    }
+
+    typename Map_T::Stats stats = map.stats();
+    expect(stats.size == ref.size(), "stats size", round);
+    if(!ref.empty())
+    {
+        expect(stats.black_height == stats.min_black_height, "black height", round);
+        expect(stats.height <= 2 * std::log2(ref.size() + 1.0), "height bound", round);
+    }
+}
+
+/*A lookup key of another type than Key_T, to reach the heterogeneous
+overloads: a const char * for string keys, the key itself otherwise*/
+static const char *probe(const std::string &key)
+{
+    return key.c_str();
+}
+template<typename Key_T>
+static const Key_T &probe(const Key_T &key)
+{
+    return key;
+}
+
+/*Compare every keyed lookup, the batch lookups, scan_chunks and the
+parallel walks against ref*/
+template<typename Map_T, typename Ref_T, typename KeyFn, typename RNG_T>
+void check_lookups(Map_T &map, const Ref_T &ref, KeyFn key_of, RNG_T &rng, size_t round)
+{
+    typedef typename Ref_T::key_type Key_T;
+    typedef typename Ref_T::mapped_type Mapped_T;
+    const Map_T &const_map = map;
+    std::vector<Key_T> keys;
+    for(int i = 0; i < 20; i++)
+    {
+        Key_T key = key_of(rng() % 2000);
+        keys.push_back(key);
+        typename Ref_T::const_iterator expected = ref.find(key);
+        bool present = expected != ref.end();
+        expect(map.count(key) == ref.count(key), "count", round);
+        expect((map.find(probe(key)) != map.end()) == present, "heterogeneous find", round);
+        const Mapped_T *value = const_map.try_get(probe(key));
+        expect(present ? value != nullptr && *value == expected->second : value == nullptr, "try_get", round);
+        bool thrown = false;
+        try
+        {
+            const Mapped_T &at_value = map.at(probe(key));
+            expect(present && at_value == expected->second, "at", round);
+        }
+        catch(const std::out_of_range &)
+        {
+            thrown = true;
+        }
+        expect(thrown == !present, "at on a missing key", round);
+    }
+
+    std::vector<Mapped_T *> found;
+    std::vector<bool> contained;
+    map.find_batch(keys, found);
+    map.contains_batch(keys, contained);
+    expect(found.size() == keys.size() && contained.size() == keys.size(), "batch sizes", round);
+    for(size_t i = 0; i < keys.size() && i < found.size() && i < contained.size(); i++)
+    {
+        typename Ref_T::const_iterator expected = ref.find(keys[i]);
+        bool present = expected != ref.end();
+        expect(contained[i] == present, "contains_batch", round);
+        expect(present ? found[i] != nullptr && *found[i] == expected->second : found[i] == nullptr,
+            "find_batch", round);
+    }
+
+    //a random range, empty when hi < lo
+    Key_T lo = key_of(rng() % 2000);
+    Key_T hi = key_of(rng() % 2000);
+    typename Ref_T::const_iterator expected = ref.lower_bound(lo);
+    typename Ref_T::const_iterator expected_end = hi < lo ? expected : ref.lower_bound(hi);
+    std::vector<Key_T> key_buf(7);
+    std::vector<Mapped_T> value_buf(7);
+    bool same = true;
+    size_t scanned = map.scan_chunks(probe(lo), probe(hi), key_buf.data(), value_buf.data(), key_buf.size(),
+        [&](const Key_T *chunk_keys, const Mapped_T *chunk_values, size_t count)
+    {
+        for(size_t i = 0; i < count && same; i++)
+        {
+            same = expected != expected_end && chunk_keys[i] == expected->first
+                && chunk_values[i] == expected->second;
+            if(same)
+            {
+                ++expected;
+            }
+        }
+    });
+    expect(same && expected == expected_end, "scan_chunks entries", round);
+    expect(scanned == static_cast<size_t>(std::distance(hi < lo ? expected_end : ref.lower_bound(lo), expected_end)),
+        "scan_chunks count", round);
+
+    std::atomic<size_t> visited(0);
+    std::atomic<size_t> wrong(0);
+    map.parallel_for_each([&](const Key_T &key, Mapped_T &value)
+    {
+        typename Ref_T::const_iterator entry = ref.find(key);
+        if(entry == ref.end() || !(entry->second == value))
+        {
+            wrong++;
+        }
+        visited++;
+    }, 4);
+    expect(wrong == 0 && visited == ref.size(), "parallel_for_each", round);
+    size_t matching = const_map.parallel_reduce(size_t(0), [&](const Key_T &key, const Mapped_T &value)
+    {
+        typename Ref_T::const_iterator entry = ref.find(key);
+        return entry != ref.end() && entry->second == value ? size_t(1) : size_t(0);
+    }, [](size_t a, size_t b)
+    {
+        return a + b;
+    }, 3);
+    expect(matching == ref.size(), "parallel_reduce", round);
+}
+
+/*One randomized run. key_of and value_of turn numbers into keys and
+values, so the same driver covers inline and class keys and both value
+policies.*/
+template<typename Key_T, typename Mapped_T, typename Values, typename KeyFn, typename ValueFn>
+void run(const std::string &name, KeyFn key_of, ValueFn value_of, bool filter, bool finger)
+{
+    typedef Map<Key_T, Mapped_T, Values> Map_T;
+    std::mt19937 rng(2024);
+    Map_T map;
+    Map_T other;
+    std::map<Key_T, Mapped_T> ref;
+    std::map<Key_T, Mapped_T> other_ref;
+    if(filter)
+    {
+        map.set_membership_filter(true);
+    }
+    map.set_finger_search(finger);
+    size_t before = failures;
+
+    for(size_t round = 0; round < 300; round++)
+    {
+        switch(rng() % 11)
+        {
+            case 0:
+            case 1:
+            {
+                //plain inserts and erases
+                for(int i = 0; i < 200; i++)
+                {
+                    unsigned n = rng() % 2000;
+                    if(rng() % 3 == 0)
+                    {
+                        Key_T key = key_of(n);
+                        map.erase(probe(key));
+                        ref.erase(key);
+                    }
+                    else
+                    {
+                        map.insert_or_assign(key_of(n), value_of(n + round));
+                        ref[key_of(n)] = value_of(n + round);
+                    }
+                }
+                break;
+            }
+            case 2:
+            {
+                //a WriteBatch with repeated keys, last operation wins
+                typename Map_T::WriteBatch batch;
+                for(int i = 0; i < 80; i++)
+                {
+                    unsigned n = rng() % 2000;
+                    if(rng() % 4 == 0)
+                    {
+                        batch.erase(key_of(n));
+                        ref.erase(key_of(n));
+                    }
+                    else
+                    {
+                        batch.put(key_of(n), value_of(n * 3 + round));
+                        ref[key_of(n)] = value_of(n * 3 + round);
+                    }
+                }
+                map.apply(batch);
+                break;
+            }
+            case 3:
+            {
+                //move some nodes to other and back again through merge
+                for(int i = 0; i < 20; i++)
+                {
+                    unsigned n = rng() % 2000;
+                    typename Map_T::NodeHandle handle = map.extract(key_of(n));
+                    if(!handle.empty())
+                    {
+                        other.insert(std::move(handle));
+                        other_ref.insert(*ref.find(key_of(n)));
+                        ref.erase(key_of(n));
+                    }
+                }
+                if(rng() % 2 == 0)
+                {
+                    map.merge(other);
+                    for(auto it = other_ref.begin(); it != other_ref.end();)
+                    {
+                        if(ref.insert(*it).second)
+                        {
+                            it = other_ref.erase(it);
+                        }
+                        else
+                        {
+                            ++it;
+                        }
+                    }
+                }
+                check(other, other_ref, round);
+                break;
+            }
+            case 4:
+            {
+                //erase a key range of up to 50 numbers
+                unsigned n = rng() % 2000;
+                Key_T lo = key_of(n);
+                Key_T hi = key_of(n + rng() % 50);
+                if(hi < lo)
+                {
+                    std::swap(lo, hi);
+                }
+                map.erase_range(lo, hi);
+                ref.erase(ref.lower_bound(lo), ref.lower_bound(hi));
+                break;
+            }
+            case 5:
+            {
+                //compact in a few bounded steps with writes in between
+                while(!map.compact(1 + rng() % 200))
+                {
+                    unsigned n = rng() % 2000;
+                    map.insert_or_assign(key_of(n), value_of(n));
+                    ref[key_of(n)] = value_of(n);
+                }
+                break;
+            }
+            case 6:
+            {
+                //split off the upper part and merge it back
+                Map_T upper;
+                Key_T at = key_of(rng() % 2000);
+                map.split(at, upper);
+                std::map<Key_T, Mapped_T> upper_ref(ref.lower_bound(at), ref.end());
+                ref.erase(ref.lower_bound(at), ref.end());
+                check(map, ref, round);
+                check(upper, upper_ref, round);
+                map.merge(upper);
+                ref.insert(upper_ref.begin(), upper_ref.end());
+                break;
+            }
+            case 7:
+            {
+                //operator[] and try_emplace, which only insert if absent
+                for(int i = 0; i < 100; i++)
+                {
+                    unsigned n = rng() % 2000;
+                    if(rng() % 2 == 0)
+                    {
+                        map[key_of(n)] = value_of(n + round);
+                        ref[key_of(n)] = value_of(n + round);
+                    }
+                    else
+                    {
+                        std::pair<Mapped_T *, bool> placed = map.try_emplace(key_of(n), value_of(n * 5));
+                        bool inserted = ref.emplace(key_of(n), value_of(n * 5)).second;
+                        expect(placed.second == inserted, "try_emplace inserted", round);
+                        expect(*placed.first == ref.at(key_of(n)), "try_emplace value", round);
+                    }
+                }
+                break;
+            }
+            case 8:
+            {
+                //a Cursor walking mostly nearby keys
+                typename Map_T::Cursor cursor(map);
+                unsigned n = rng() % 2000;
+                for(int i = 0; i < 100; i++)
+                {
+                    n = (n + rng() % 40) % 2000;
+                    Key_T key = key_of(n);
+                    switch(rng() % 3)
+                    {
+                        case 0:
+                        {
+                            Mapped_T *value = cursor.find(probe(key));
+                            typename std::map<Key_T, Mapped_T>::const_iterator expected = ref.find(key);
+                            expect(expected == ref.end() ? value == nullptr
+                                : value != nullptr && *value == expected->second, "Cursor find", round);
+                            break;
+                        }
+                        case 1:
+                        {
+                            std::pair<Mapped_T *, bool> placed = cursor.insert(key, value_of(n + 7));
+                            bool inserted = ref.insert({key, value_of(n + 7)}).second;
+                            expect(placed.second == inserted && *placed.first == ref.at(key), "Cursor insert", round);
+                            break;
+                        }
+                        default:
+                        {
+                            expect(cursor.erase(probe(key)) == (ref.erase(key) == 1), "Cursor erase", round);
+                            break;
+                        }
+                    }
+                }
+                break;
+            }
+            case 9:
+            {
+                //rebuild from the sorted reference
+                map.assign_sorted(ref.begin(), ref.end());
+                break;
+            }
+            default:
+            {
+                //pop from both ends
+                for(int i = 0; i < 5 && !ref.empty(); i++)
+                {
+                    map.pop_front();
+                    ref.erase(ref.begin());
+                }
+                for(int i = 0; i < 5 && !ref.empty(); i++)
+                {
+                    map.pop_back();
+                    ref.erase(std::prev(ref.end()));
+                }
+                break;
+            }
+        }
+        check(map, ref, round);
+        check_lookups(map, ref, key_of, rng, round);
+        if(failures != before)
+        {
+            break;
+        }
+    }
+    std::cout << name << (failures == before ? ": ok" : ": FAILED") << " (" << ref.size() << " entries)" << std::endl;
+}
+
+typedef std::array<unsigned, 16> Wide;
+
+/*A value whose copies start throwing once countdown runs out; moves never
+throw, so only the copies Map itself makes can fail*/
+struct Fragile
+{
+    long value = 0;
+    static long countdown;
+    Fragile()
+    {
+
+    }
+    Fragile(long v) : value(v)
+    {
+
+    }
+    Fragile(const Fragile &other) : value(other.value)
+    {
+        tick();
+    }
+    Fragile(Fragile &&other) noexcept : value(other.value)
+    {
+
+    }
+    Fragile &operator=(const Fragile &other)
+    {
+        tick();
+        value = other.value;
+        return *this;
+    }
+    Fragile &operator=(Fragile &&other) noexcept
+    {
+        value = other.value;
+        return *this;
+    }
+    bool operator==(const Fragile &other) const
+    {
+        return value == other.value;
+    }
+    static void tick()
+    {
+        if(countdown > 0 && --countdown == 0)
+        {
+            throw std::runtime_error("copy failed");
+        }
+    }
+};
+long Fragile::countdown = 0;
+
+/*Let copies fail part way through a large WriteBatch and assign_sorted.
+The Map must keep exactly its old keys with a valid tree after a failed
+batch, end up empty after a failed assign_sorted, and leak nothing.*/
+template<typename Values>
+void throwing_values(const std::string &name)
+{
+    typedef Map<int, Fragile, Values> Map_T;
+    size_t before = failures;
+    for(long fail_at : {1, 2, 7, 60, 250})
+    {
+        Map_T map;
+        std::map<int, Fragile> ref;
+        for(int i = 0; i < 1000; i += 2)
+        {
+            map.insert_or_assign(i, Fragile(i));
+            ref[i] = Fragile(i);
+        }
+        typename Map_T::WriteBatch batch;
+        for(int i = 0; i < 600; i++)
+        {
+            if(i % 3 == 0)
+            {
+                batch.erase(i);
+            }
+            else
+            {
+                batch.put(i, Fragile(-i));
+            }
+        }
+        Fragile::countdown = fail_at;
+        bool thrown = false;
+        try
+        {
+            map.apply(batch);
+        }
+        catch(const std::runtime_error &)
+        {
+            thrown = true;
+        }
+        Fragile::countdown = 0;
+        expect(thrown, "batch copy did not throw", fail_at);
+
+        //overwritten values may have changed, the key set may not
+        for(auto &entry : ref)
+        {
+            const Fragile *value = map.try_get(entry.first);
+            expect(value != nullptr, "key lost by failed batch", fail_at);
+            if(value != nullptr)
+            {
+                entry.second = *value;
+            }
+        }
+        check(map, ref, fail_at);
+
+        std::vector<std::pair<int, Fragile>> sorted;
+        for(int i = 0; i < 300; i++)
+        {
+            sorted.push_back({i, Fragile(i)});
+        }
+        Fragile::countdown = fail_at;
+        thrown = false;
+        try
+        {
+            map.assign_sorted(sorted.begin(), sorted.end());
+        }
+        catch(const std::runtime_error &)
+        {
+            thrown = true;
+        }
+        Fragile::countdown = 0;
+        expect(thrown, "assign_sorted copy did not throw", fail_at);
+        expect(map.empty() && map.begin() == map.end(), "failed assign_sorted left entries", fail_at);
+    }
+    std::cout << name << (failures == before ? ": ok" : ": FAILED") << std::endl;
+}
+
+/*Change keys through NodeHandles before reinserting them; string keys
+cache a prefix and length in the node that must follow the new key*/
+void rekeyed_handles()
+{
+    Map<std::string, int> map;
+    std::map<std::string, int> ref;
+    for(int i = 0; i < 200; i++)
+    {
+        std::string key = std::string(10, static_cast<char>('a' + i % 26)) + std::to_string(i);
+        map.insert({key, i});
+        ref[key] = i;
+    }
+    std::mt19937 rng(7);
+    size_t before = failures;
+    for(size_t round = 0; round < 100; round++)
+    {
+        auto pick = ref.begin();
+        std::advance(pick, rng() % ref.size());
+        std::string key = pick->first;
+        int value = pick->second;
+        Map<std::string, int>::NodeHandle handle = map.extract(key);
+        ref.erase(key);
+        handle.key() = std::string(round % 3 == 0 ? 4 : 12, static_cast<char>('a' + rng() % 26)) + std::to_string(round);
+        key = handle.key();
+        bool inserted = map.insert(std::move(handle)).second;
+        expect(inserted == ref.insert({key, value}).second, "rekeyed insert", round);
+        expect(map.count(key) == 1, "rekeyed key not found", round);
+        check(map, ref, round);
+    }
+    std::cout << "rekeyed handles" << (failures == before ? ": ok" : ": FAILED") << std::endl;
+}
+
+int main()
+{
+    auto int_key = [](unsigned n)
+    {
+        return static_cast<int>(n);
+    };
+    auto string_key = [](unsigned n)
+    {
+        return "key-" + std::to_string(n);
+    };
+    auto int_value = [](unsigned n)
+    {
+        return static_cast<long>(n);
+    };
+    auto string_value = [](unsigned n)
+    {
+        return std::string(n % 40, 'v');
+    };
+    auto wide_value = [](unsigned n)
+    {
+        Wide value;
+        value.fill(n);
+        return value;
+    };
+
+    run<int, long, InlineValues>("int/long inline", int_key, int_value, false, false);
+    run<int, long, InlineValues>("int/long inline, filter and finger", int_key, int_value, true, true);
+    run<std::string, std::string, InlineValues>("string/string inline", string_key, string_value, true, false);
+    run<int, Wide, SlabValues>("int/wide slab", int_key, wide_value, false, true);
+    run<std::string, std::string, SlabValues>("string/string slab", string_key, string_value, true, true);
+    throwing_values<InlineValues>("throwing copies inline");
+    throwing_values<SlabValues>("throwing copies slab");
+    rekeyed_handles();
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
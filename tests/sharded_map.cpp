@@ -0,0 +1,146 @@
+#include "ShardedMap.hpp"
+#include <atomic>
+#include <cstdlib>
+#include <iostream>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+using namespace kanec1994;
+
+/*Writers on several threads while another thread keeps forcing
+rebalance() and readers walk the map with for_each and for_each_range.
+Every walk must see strictly ascending keys inside its range with values
+matching their keys, and once the writers finish the contents must match
+what they wrote. Exits non-zero at the first mismatch.*/
+
+static std::atomic<size_t> failures(0);
+
+static void expect(bool ok, const std::string &what)
+{
+    if(!ok)
+    {
+        if(failures++ == 0)
+        {
+            std::cerr << what << std::endl;
+        }
+    }
+}
+
+static const int writers = 4;
+static const int keys_per_writer = 20000;
+
+/*Writer t owns the keys congruent to t mod writers. It writes them
+twice, first crowded into a hot low range so that shards split, then
+spread out, and erases every fifth one.*/
+static void write_keys(ShardedMap<int, int> &map, int t)
+{
+    for(int i = 0; i < keys_per_writer; i++)
+    {
+        int key = i * writers + t;
+        map.insert(key % 2000, (key % 2000) * 2);
+        map.insert_or_assign(key, key * 2);
+        if(i % 5 == 0)
+        {
+            map.erase(key);
+        }
+    }
+}
+
+/*Walk entries, checking order, bounds and values, and return how many
+were seen*/
+static size_t walk(const ShardedMap<int, int> &map, bool ranged, int lo, int hi)
+{
+    size_t seen = 0;
+    bool started = false;
+    int previous = 0;
+    auto visit = [&](const int &key, const int &value)
+    {
+        expect(!started || previous < key, "keys out of order: " + std::to_string(previous)
+            + " then " + std::to_string(key));
+        expect(!ranged || (lo <= key && key < hi), "key " + std::to_string(key) + " outside range");
+        expect(value == key * 2, "value does not match key " + std::to_string(key));
+        started = true;
+        previous = key;
+        seen++;
+    };
+    if(ranged)
+    {
+        map.for_each_range(lo, hi, visit);
+    }
+    else
+    {
+        map.for_each(visit);
+    }
+    return seen;
+}
+
+int main()
+{
+    ShardedMap<int, int> map(std::vector<int>(), 16, 500);
+    std::atomic<bool> writing(true);
+
+    std::vector<std::thread> threads;
+    for(int t = 0; t < writers; t++)
+    {
+        threads.emplace_back([&map, t]
+        {
+            write_keys(map, t);
+        });
+    }
+    std::thread rebalancer([&]
+    {
+        while(writing)
+        {
+            map.rebalance();
+            std::this_thread::yield();
+        }
+    });
+    std::thread reader([&]
+    {
+        int round = 0;
+        while(writing)
+        {
+            walk(map, false, 0, 0);
+            int lo = (round * 7919) % (writers * keys_per_writer);
+            walk(map, true, lo, lo + 5000);
+            round++;
+        }
+    });
+    for(std::thread &thread : threads)
+    {
+        thread.join();
+    }
+    writing = false;
+    rebalancer.join();
+    reader.join();
+
+    std::map<int, int> expected;
+    for(int key = 0; key < writers * keys_per_writer; key++)
+    {
+        if((key / writers) % 5 != 0 || key < 2000)
+        {
+            expected[key] = key * 2;
+        }
+    }
+    expect(map.size() == expected.size(), "size " + std::to_string(map.size()) + ", expected "
+        + std::to_string(expected.size()));
+    expect(walk(map, false, 0, 0) == expected.size(), "for_each count");
+    expect(walk(map, true, 1000, 3000) == static_cast<size_t>(std::distance(expected.lower_bound(1000),
+        expected.lower_bound(3000))), "for_each_range count");
+    for(const std::pair<const int, int> &entry : expected)
+    {
+        int value = 0;
+        if(!map.get(entry.first, value) || value != entry.second)
+        {
+            expect(false, "key " + std::to_string(entry.first) + " missing or wrong");
+            break;
+        }
+    }
+    expect(map.shard_count() > 1, "hot range never split");
+
+    std::cout << "sharded map: " << (failures == 0 ? "ok" : "FAILED") << " (" << map.size() << " entries, "
+        << map.shard_count() << " shards)" << std::endl;
+    return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}